@@ -0,0 +1,191 @@
+#pragma once
+
+// This file contains what `Queue::pop()` needs to be `co_await`ed by a C++20
+// coroutine: `PopAwaiter`, which is what `pop()` returns, and `PopWaiters`,
+// the list of suspended coroutines that `Queue` keeps.
+//
+// A coroutine that awaits an empty queue suspends and adds itself to the
+// list. A later push pops the front element on the waiter's behalf and
+// resumes it, either right there on the pushing thread, or by handing it to
+// an executor that the coroutine supplied. Each waiter lives in its
+// coroutine's frame, so waiting allocates nothing.
+//
+// It also contains `Detached`, a minimal coroutine type for tests and
+// benchmarks.
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+// `PopWaiter<T>` is a suspended coroutine waiting for a `T`.
+template <typename T>
+struct PopWaiter {
+    std::coroutine_handle<> handle;
+    // If `schedule` is not null, then the coroutine is resumed by calling
+    // `schedule(executor, handle)`. Otherwise, it's resumed directly.
+    void (*schedule)(void *executor, std::coroutine_handle<>) = nullptr;
+    void *executor = nullptr;
+    std::optional<T> element;
+    PopWaiter *next = nullptr;
+};
+
+// `PopWaiters<T>` is a first-in-first-out list of `PopWaiter<T>`s, guarded by
+// a mutex. Pushes check `count` first, so they take the mutex only when
+// there are waiters.
+//
+// A waiter is added only after trying the queue once more with the mutex
+// held, and is removed only by `wake`, with the mutex held, when an element
+// is popped for it. So a waiter is never in the list while there's an
+// element it could have had: either the pushing thread sees the waiter, or
+// the waiter sees the element. This relies on `count` and the queue's
+// operations being sequentially consistent.
+template <typename T>
+class PopWaiters {
+    std::mutex mutex;
+    PopWaiter<T> *head;
+    PopWaiter<T> *tail;
+    std::atomic<std::size_t> count;
+
+public:
+    PopWaiters();
+
+    // Call `try_pop()`. If it returns an element, put the element in
+    // `waiter` and return `false`. Otherwise, add `waiter` to the list and
+    // return `true`.
+    template <typename TryPop>
+    bool pop_or_wait(PopWaiter<T>& waiter, TryPop&& try_pop);
+
+    // While there are waiters and `try_pop()` returns elements, give them to
+    // the waiters in order, and then resume those waiters.
+    template <typename TryPop>
+    void wake(TryPop&& try_pop);
+};
+
+template <typename T>
+PopWaiters<T>::PopWaiters()
+: head(nullptr)
+, tail(nullptr)
+, count(0) {}
+
+template <typename T>
+template <typename TryPop>
+bool PopWaiters<T>::pop_or_wait(PopWaiter<T>& waiter, TryPop&& try_pop) {
+    std::lock_guard<std::mutex> lock(mutex);
+    count.fetch_add(1);
+    if ((waiter.element = try_pop())) {
+        count.fetch_sub(1);
+        return false;
+    }
+    waiter.next = nullptr;
+    (tail ? tail->next : head) = &waiter;
+    tail = &waiter;
+    return true;
+}
+
+template <typename T>
+template <typename TryPop>
+void PopWaiters<T>::wake(TryPop&& try_pop) {
+    if (!count.load()) {
+        return;
+    }
+
+    PopWaiter<T> *ready = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        PopWaiter<T> **ready_tail = &ready;
+        while (head) {
+            if (!(head->element = try_pop())) {
+                break;
+            }
+            PopWaiter<T> *const waiter = head;
+            head = waiter->next;
+            if (!head) {
+                tail = nullptr;
+            }
+            count.fetch_sub(1);
+            waiter->next = nullptr;
+            *ready_tail = waiter;
+            ready_tail = &waiter->next;
+        }
+    }
+
+    while (ready) {
+        // Resuming the coroutine can end its frame, and the waiter with it.
+        PopWaiter<T> *const waiter = ready;
+        ready = waiter->next;
+        if (waiter->schedule) {
+            waiter->schedule(waiter->executor, waiter->handle);
+        } else {
+            waiter->handle.resume();
+        }
+    }
+}
+
+// `PopAwaiter<SomeQueue, T>` is the awaitable returned by `pop()`. Awaiting
+// it yields the front element of the queue, suspending until there is one.
+template <typename SomeQueue, typename T>
+class PopAwaiter {
+    SomeQueue& queue;
+    PopWaiters<T>& waiters;
+    PopWaiter<T> waiter;
+
+public:
+    PopAwaiter(SomeQueue& queue, PopWaiters<T>& waiters);
+    // Resume through `executor.schedule(std::coroutine_handle<>)`, which must
+    // outlive the wait.
+    template <typename Executor>
+    PopAwaiter(SomeQueue& queue, PopWaiters<T>& waiters, Executor& executor);
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> handle);
+    T await_resume();
+};
+
+template <typename SomeQueue, typename T>
+PopAwaiter<SomeQueue, T>::PopAwaiter(SomeQueue& queue, PopWaiters<T>& waiters)
+: queue(queue)
+, waiters(waiters) {}
+
+template <typename SomeQueue, typename T>
+template <typename Executor>
+PopAwaiter<SomeQueue, T>::PopAwaiter(SomeQueue& queue, PopWaiters<T>& waiters, Executor& executor)
+: queue(queue)
+, waiters(waiters) {
+    waiter.schedule = [](void *executor, std::coroutine_handle<> handle) {
+        static_cast<Executor*>(executor)->schedule(handle);
+    };
+    waiter.executor = &executor;
+}
+
+template <typename SomeQueue, typename T>
+bool PopAwaiter<SomeQueue, T>::await_ready() {
+    return bool(waiter.element = queue.try_pop_front());
+}
+
+template <typename SomeQueue, typename T>
+bool PopAwaiter<SomeQueue, T>::await_suspend(std::coroutine_handle<> handle) {
+    waiter.handle = handle;
+    return waiters.pop_or_wait(waiter, [this]() { return queue.try_pop_front(); });
+}
+
+template <typename SomeQueue, typename T>
+T PopAwaiter<SomeQueue, T>::await_resume() {
+    return std::move(*waiter.element);
+}
+
+// `Detached` is the return type of a coroutine that starts running when
+// called and destroys itself when it finishes. Nothing can wait for it, and
+// an exception escaping it terminates the program.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
@@ -0,0 +1,158 @@
+#include "bench.h"
+#include "bench_results.h"
+#include "lock_free_bag.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+void bench_tagged_ptr(const BenchConfig& config) {
+    for (const int n_threads : config.thread_counts) {
+        measure(config, "TaggedPtr ptr/bit", n_threads, [&]() {
+            const double seconds = run_threads(n_threads, [&](int) {
+                int targets[2];
+                TaggedPtr<int> tagged;
+                for (long i = 0; i < config.ops_per_thread; ++i) {
+                    tagged.ptr(&targets[i & 1]);
+                    tagged.bit(i & 2);
+                    do_not_optimize(tagged.ptr());
+                    do_not_optimize(tagged.bit());
+                }
+            });
+            return Trial{double(n_threads) * config.ops_per_thread, seconds};
+        });
+    }
+}
+
+void bench_atomic_tagged_ptr(const BenchConfig& config) {
+    for (const int n_threads : config.thread_counts) {
+        measure(config, "AtomicTaggedPtr CAS (shared)", n_threads, [&]() {
+            AtomicTaggedPtr<int> shared;
+            const double seconds = run_threads(n_threads, [&](int) {
+                for (long i = 0; i < config.ops_per_thread; ++i) {
+                    TaggedPtr<int> expected = shared.load();
+                    while (!shared.compare_exchange_weak(expected, TaggedPtr<int>(expected.ptr(), !expected.bit()))) {}
+                }
+            });
+            return Trial{double(n_threads) * config.ops_per_thread, seconds};
+        });
+    }
+}
+
+// Each thread repeatedly puts an element into the container and then takes
+// one out, so the container stays nearly empty.
+//
+// For `Queue`, this measures allocating a node per push, plus a free list
+// that grows by a node per pop. Nodes are almost never reused: the busy bit
+// that linking sets on the old tail is never cleared, so the free list's
+// head always looks busy and pushes allocate instead. That's a known leak.
+// Clearing the bit alone isn't a fix, since reuse would then expose ABA
+// problems on the free list. `LockFreeBag`, by contrast, does reuse its
+// nodes through its per-thread caches.
+void bench_push_then_pop(const BenchConfig& config) {
+    for (const int n_threads : config.thread_counts) {
+        measure(config, "Queue<int> push then pop, allocating (pairs)", n_threads, [&]() {
+            Queue<int> queue;
+            const double seconds = run_threads(n_threads, [&](int i) {
+                for (long j = 0; j < config.ops_per_thread; ++j) {
+                    queue.push_back(int(i + j));
+                    while (!queue.try_pop_front()) {}
+                }
+            });
+            return Trial{double(n_threads) * config.ops_per_thread, seconds};
+        });
+
+        measure(config, "LockFreeBag<int> reuse (pairs)", n_threads, [&]() {
+            LockFreeBag<int> bag;
+            const double seconds = run_threads(n_threads, [&](int i) {
+                for (long j = 0; j < config.ops_per_thread; ++j) {
+                    bag.add(int(i + j));
+                    while (!bag.try_remove()) {}
+                }
+            });
+            return Trial{double(n_threads) * config.ops_per_thread, seconds};
+        });
+    }
+}
+
+// Return the name of the benchmark of `operation` on a `Q<T>`, e.g.
+// "Queue<int>::push_back".
+template <template <typename> class Q, typename Traits>
+std::string bench_name(const char *operation) {
+    return std::string(EngineTraits<Q>::name) + "<" + Traits::name() + ">" + operation;
+}
+
+template <template <typename> class Q, typename T, typename Traits>
+void bench_push_back(const BenchConfig& config) {
+    const std::string name = bench_name<Q, Traits>("::push_back");
+    const long ops = scaled_ops(config, sizeof(T));
+    for (const int n_threads : config.thread_counts) {
+        measure(config, name, n_threads, [&]() {
+            const auto queue = EngineTraits<Q>::template make<T>(n_threads * ops);
+            const double seconds = run_threads(n_threads, [&](int) {
+                for (long j = 0; j < ops; ++j) {
+                    queue->push_back(Traits::make(j));
+                }
+            });
+            return Trial{double(n_threads) * ops, seconds};
+        });
+    }
+}
+
+template <template <typename> class Q, typename T, typename Traits>
+void bench_try_pop_front(const BenchConfig& config) {
+    const std::string name = bench_name<Q, Traits>("::try_pop_front");
+    const long ops = scaled_ops(config, sizeof(T));
+    for (const int n_threads : config.thread_counts) {
+        measure(config, name, n_threads, [&]() {
+            const auto queue = EngineTraits<Q>::template make<T>(n_threads * ops);
+            for (long j = 0; j < n_threads * ops; ++j) {
+                queue->push_back(Traits::make(j));
+            }
+            const double seconds = run_threads(n_threads, [&](int) {
+                for (long j = 0; j < ops; ++j) {
+                    do_not_optimize(queue->try_pop_front());
+                }
+            });
+            return Trial{double(n_threads) * ops, seconds};
+        });
+    }
+}
+
+template <template <typename> class Q, typename T, typename Traits>
+void bench_pairs(const BenchConfig& config) {
+    const long ops = scaled_ops(config, sizeof(T));
+    for (const std::pair<int, int>& split : producer_consumer_splits(config)) {
+        const int producers = split.first;
+        const int consumers = split.second;
+        const std::string name = bench_name<Q, Traits>(" pairs ")
+            + std::to_string(producers) + "P:" + std::to_string(consumers) + "C";
+        measure(config, name, producers + consumers, [&]() {
+            const auto queue = EngineTraits<Q>::template make<T>(pairs_capacity);
+            return run_pairs<T, Traits>(*queue, producers, consumers, ops);
+        });
+    }
+}
+
+// Run every workload on every engine with elements of type `T`.
+template <typename T, typename Traits = PayloadTraits<T>>
+void bench_payload(const BenchConfig& config) {
+    for_each_engine([&]<template <typename> class Q>() {
+        bench_push_back<Q, T, Traits>(config);
+        bench_try_pop_front<Q, T, Traits>(config);
+        bench_pairs<Q, T, Traits>(config);
+    });
+}
+
+int main(int argc, char *argv[]) {
+    const BenchConfig config = parse_bench_args(argc, argv);
+
+    bench_tagged_ptr(config);
+    bench_atomic_tagged_ptr(config);
+    bench_push_then_pop(config);
+    bench_payload<int>(config);
+    bench_payload<std::string, SsoString>(config);
+    bench_payload<std::string, HeapString>(config);
+    bench_payload<Payload1K>(config);
+    return save_results(config, "bench") ? 0 : 1;
+}
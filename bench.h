@@ -0,0 +1,453 @@
+#pragma once
+
+// This file contains the benchmark harness shared by the benchmark programs:
+// command line configuration, the queue engines and element types and
+// thread splits that workloads are run with, running a function on several
+// threads at once, repeating measurements, and summarizing them as a mean
+// with a confidence interval, optionally alongside hardware performance
+// counters.
+
+#include "lock_free_queue.h"
+#include "perf_counters.h"
+#include "reference_queues.h"
+#include "topology.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct BenchConfig {
+    // Number of times each benchmark is measured.
+    int repetitions = 5;
+    // Number of operations each thread performs per repetition.
+    long ops_per_thread = 200'000;
+    // If not empty, run only benchmarks whose name contains `filter`.
+    std::string filter;
+    std::vector<int> thread_counts = {1, 2, 4, 8};
+    // Whether `thread_counts` was given on the command line.
+    bool thread_counts_given = false;
+    // Whether to count hardware events during each benchmark.
+    bool perf = false;
+    // Whether `measure` prints each result.
+    bool print = true;
+    // If not empty, the path of a JSON file to which the program writes all
+    // results when it's done (see `bench_results.h`).
+    std::string json_path;
+
+    bool selected(const std::string& name) const {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+};
+
+// Parse `--reps N`, `--ops N`, `--threads 1,2,4`, `--perf`, `--json PATH` and
+// an optional filter from the command line. Print usage and exit on anything
+// else.
+inline BenchConfig parse_bench_args(int argc, char *argv[]) {
+    BenchConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--reps N] [--ops N] [--threads N,N,...] [--perf] [--json PATH] [FILTER]\n";
+        std::exit(2);
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--reps" && i + 1 < argc) {
+            config.repetitions = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--ops" && i + 1 < argc) {
+            config.ops_per_thread = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            config.thread_counts.clear();
+            config.thread_counts_given = true;
+            const std::string list = argv[++i];
+            for (std::size_t begin = 0; begin < list.size();) {
+                std::size_t end = list.find(',', begin);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                config.thread_counts.push_back(std::max(1, std::atoi(list.substr(begin, end - begin).c_str())));
+                begin = end + 1;
+            }
+        } else if (arg == "--perf") {
+            config.perf = true;
+        } else if (arg == "--json" && i + 1 < argc) {
+            config.json_path = argv[++i];
+        } else if (arg.rfind("--", 0) == 0 || !config.filter.empty()) {
+            usage();
+        } else {
+            config.filter = arg;
+        }
+    }
+    return config;
+}
+
+// `EngineTraits<Q>` names the queue template `Q` and creates `Q<T>`s.
+// `make<T>(capacity)` ignores `capacity` unless the engine is bounded.
+template <template <typename> class Q>
+struct EngineTraits;
+
+template <template <typename> class Q>
+struct UnboundedEngineTraits {
+    template <typename T>
+    static std::unique_ptr<Q<T>> make(std::size_t /*capacity*/) {
+        return std::make_unique<Q<T>>();
+    }
+};
+
+template <>
+struct EngineTraits<Queue> : UnboundedEngineTraits<Queue> {
+    static constexpr const char *name = "Queue";
+};
+
+template <>
+struct EngineTraits<MutexDequeQueue> : UnboundedEngineTraits<MutexDequeQueue> {
+    static constexpr const char *name = "MutexDequeQueue";
+};
+
+template <>
+struct EngineTraits<SpinlockQueue> : UnboundedEngineTraits<SpinlockQueue> {
+    static constexpr const char *name = "SpinlockQueue";
+};
+
+template <>
+struct EngineTraits<TwoLockQueue> : UnboundedEngineTraits<TwoLockQueue> {
+    static constexpr const char *name = "TwoLockQueue";
+};
+
+template <>
+struct EngineTraits<BoundedRingQueue> {
+    static constexpr const char *name = "BoundedRingQueue";
+    template <typename T>
+    static std::unique_ptr<BoundedRingQueue<T>> make(std::size_t capacity) {
+        return std::make_unique<BoundedRingQueue<T>>(capacity);
+    }
+};
+
+// Invoke `visitor.template operator()<Q>()` for each queue engine `Q`,
+// starting with `Queue`.
+template <typename Visitor>
+void for_each_engine(Visitor&& visitor) {
+    visitor.template operator()<Queue>();
+    visitor.template operator()<MutexDequeQueue>();
+    visitor.template operator()<SpinlockQueue>();
+    visitor.template operator()<TwoLockQueue>();
+    visitor.template operator()<BoundedRingQueue>();
+}
+
+// Return whether `name` is "all" or the name of a queue engine, i.e. whether
+// selecting engines by `name` selects any.
+inline bool selects_engine(const std::string& name) {
+    bool found = name == "all";
+    for_each_engine([&]<template <typename> class Q>() {
+        found = found || name == EngineTraits<Q>::name;
+    });
+    return found;
+}
+
+// `Payload1K` is a large, trivially copyable element type.
+struct Payload1K {
+    char bytes[1024];
+};
+
+// `PayloadTraits<T>` names each element type and makes elements of it.
+template <typename T>
+struct PayloadTraits;
+
+template <>
+struct PayloadTraits<int> {
+    static const char *name() { return "int"; }
+    static int make(long i) { return int(i); }
+};
+
+// `std::string` short enough for the small string optimization.
+struct SsoString {
+    static const char *name() { return "string/sso"; }
+    static std::string make(long i) { return std::to_string(i % 1000); }
+};
+
+// `std::string` too long for the small string optimization.
+struct HeapString {
+    static const char *name() { return "string/heap"; }
+    static std::string make(long i) { return std::string(64, 'a' + i % 26); }
+};
+
+template <>
+struct PayloadTraits<Payload1K> {
+    static const char *name() { return "Payload1K"; }
+    static Payload1K make(long i) {
+        Payload1K payload;
+        std::memset(payload.bytes, int(i), sizeof payload.bytes);
+        return payload;
+    }
+};
+
+// Return the number of elements each thread should handle for the specified
+// element size, so that large elements don't use an unreasonable amount of
+// memory.
+inline long scaled_ops(const BenchConfig& config, std::size_t element_size) {
+    return std::max(1L, long(config.ops_per_thread / std::max<std::size_t>(1, element_size / 64)));
+}
+
+// Return the producer/consumer splits to measure for the configured thread
+// counts: balanced, producer-heavy and consumer-heavy.
+inline std::vector<std::pair<int, int>> producer_consumer_splits(const BenchConfig& config) {
+    std::vector<std::pair<int, int>> splits;
+    const auto add = [&](int producers, int consumers) {
+        const std::pair<int, int> split(producers, consumers);
+        if (std::find(splits.begin(), splits.end(), split) == splits.end()) {
+            splits.push_back(split);
+        }
+    };
+    for (const int n_threads : config.thread_counts) {
+        if (n_threads < 2) {
+            add(1, 1);
+            continue;
+        }
+        add(n_threads / 2, n_threads - n_threads / 2);
+        add(n_threads - 1, 1);
+        add(1, n_threads - 1);
+    }
+    return splits;
+}
+
+// Prevent the compiler from optimizing away the computation of `value`.
+template <typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Return a reference to the counters, if any, that `run_threads` starts and
+// stops around the timed part of a benchmark. `measure` sets this.
+inline PerfCounters *&active_perf_counters() {
+    static PerfCounters *counters = nullptr;
+    return counters;
+}
+
+// Run `body(thread_index)` on each of `n_threads` new threads. The threads
+// wait for each other to start before calling `body`, so that they all
+// begin at about the same time. Return the number of seconds between the
+// release of the threads and the last of them finishing.
+//
+// If `cpus` is not empty, then thread `i` is pinned to CPU
+// `cpus[i % cpus.size()]` before it starts waiting.
+template <typename Body>
+double run_threads(int n_threads, Body&& body, const std::vector<int>& cpus = {}) {
+    std::atomic<int> n_ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            if (!cpus.empty()) {
+                pin_current_thread(cpus[i % cpus.size()]);
+            }
+            ++n_ready;
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            body(i);
+        });
+    }
+
+    while (n_ready.load() < n_threads) {
+        std::this_thread::yield();
+    }
+    PerfCounters *const counters = active_perf_counters();
+    if (counters) {
+        counters->start();
+    }
+    const auto before = std::chrono::steady_clock::now();
+    go.store(true);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - before;
+    if (counters) {
+        counters->stop();
+    }
+    return elapsed.count();
+}
+
+// `Trial` is the outcome of one repetition of a benchmark.
+struct Trial {
+    double operations;
+    double seconds;
+};
+
+// The capacity to give bounded engines in `run_pairs` benchmarks, so that
+// producers sometimes wait for consumers, as they would in practice.
+inline constexpr std::size_t pairs_capacity = 4096;
+
+// Have `producers` threads push `ops` elements each into `queue` while
+// `consumers` threads pop until, between them, they've popped everything.
+// Threads alternate between producers and consumers, e.g. P C P C P P, so
+// that with a compact `cpus` placement each producer is next to a consumer.
+// Count a push and its pop as one operation.
+template <typename T, typename Traits, typename SomeQueue>
+Trial run_pairs(SomeQueue& queue, int producers, int consumers, long ops, const std::vector<int>& cpus = {}) {
+    const long total = producers * ops;
+    const int paired = std::min(producers, consumers);
+    const double seconds = run_threads(producers + consumers, [&](int i) {
+        // Map the thread index `i` to a producer or consumer index.
+        const bool producer = i < 2 * paired ? i % 2 == 0 : producers > consumers;
+        const int index = i < 2 * paired ? i / 2 : paired + (i - 2 * paired);
+        if (producer) {
+            for (long j = 0; j < ops; ++j) {
+                queue.push_back(Traits::make(j));
+            }
+            return;
+        }
+        const long quota = total / consumers + (index < total % consumers);
+        for (long popped = 0; popped < quota;) {
+            if (std::optional<T> element = queue.try_pop_front()) {
+                do_not_optimize(*element);
+                ++popped;
+            }
+        }
+    }, cpus);
+    return Trial{double(total), seconds};
+}
+
+struct BenchResult {
+    std::string name;
+    int threads;
+    // One entry per repetition.
+    std::vector<double> ops_per_second;
+    // Hardware event counts divided by the number of operations, over all
+    // repetitions. Empty unless `BenchConfig::perf` is set and the counters
+    // are available.
+    std::vector<PerfCounters::Count> per_operation;
+
+    double mean() const;
+    double stddev() const;
+    // Half of the width of the 95% confidence interval around `mean()`.
+    double ci95() const;
+};
+
+inline double BenchResult::mean() const {
+    double sum = 0;
+    for (const double value : ops_per_second) {
+        sum += value;
+    }
+    return sum / ops_per_second.size();
+}
+
+inline double BenchResult::stddev() const {
+    const std::size_t n = ops_per_second.size();
+    if (n < 2) {
+        return 0;
+    }
+    const double average = mean();
+    double sum_of_squares = 0;
+    for (const double value : ops_per_second) {
+        sum_of_squares += (value - average) * (value - average);
+    }
+    return std::sqrt(sum_of_squares / (n - 1));
+}
+
+// Return the two-sided 95% critical value of Student's t distribution with
+// the specified degrees of freedom.
+inline double student_t95(std::size_t degrees_of_freedom) {
+    static const double table[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+        2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+        2.042};
+    const std::size_t size = sizeof table / sizeof table[0];
+    if (degrees_of_freedom == 0) {
+        return 0;
+    }
+    return degrees_of_freedom < size ? table[degrees_of_freedom] : 1.960;
+}
+
+inline double BenchResult::ci95() const {
+    const std::size_t n = ops_per_second.size();
+    if (n < 2) {
+        return 0;
+    }
+    return student_t95(n - 1) * stddev() / std::sqrt(double(n));
+}
+
+// Return the results that `measure` has collected so far, in order, if
+// `BenchConfig::json_path` is set.
+inline std::vector<BenchResult>& recorded_results() {
+    static std::vector<BenchResult> results;
+    return results;
+}
+
+inline void print_result(const BenchResult& result) {
+    const double mean = result.mean();
+    std::cout << std::left << std::setw(48) << result.name << std::right
+              << " threads=" << std::setw(2) << result.threads
+              << std::fixed << std::setprecision(0)
+              << std::setw(14) << mean << " ops/s"
+              << " +/- " << std::setprecision(1) << (mean ? 100 * result.ci95() / mean : 0) << "%"
+              << std::defaultfloat << std::setprecision(6) << '\n';
+    if (result.per_operation.empty()) {
+        return;
+    }
+    std::cout << "    per op:" << std::fixed << std::setprecision(3);
+    for (const PerfCounters::Count& count : result.per_operation) {
+        std::cout << ' ' << count.name << '=' << count.value;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+// Run `trial()` once to warm up, and then `config.repetitions` times,
+// printing, recording (see `recorded_results`) and returning the resulting
+// throughput. `trial` returns a `Trial`, and must do its timed work in
+// `run_threads`. If `name` is not selected by `config`, do nothing and
+// return a result without any measurements.
+template <typename TrialFunction>
+BenchResult measure(const BenchConfig& config, const std::string& name, int threads, TrialFunction&& trial) {
+    BenchResult result{name, threads, {}, {}};
+    if (!config.selected(name)) {
+        return result;
+    }
+    (void)trial();
+
+    std::optional<PerfCounters> counters;
+    if (config.perf) {
+        counters.emplace();
+        if (counters->available()) {
+            active_perf_counters() = &*counters;
+        } else {
+            static bool warned = false;
+            if (!warned) {
+                std::cerr << "Hardware performance counters are unavailable: " << counters->error() << '\n';
+                warned = true;
+            }
+        }
+    }
+
+    double total_operations = 0;
+    for (int i = 0; i < config.repetitions; ++i) {
+        const Trial outcome = trial();
+        result.ops_per_second.push_back(outcome.operations / outcome.seconds);
+        total_operations += outcome.operations;
+    }
+
+    if (active_perf_counters()) {
+        active_perf_counters() = nullptr;
+        for (PerfCounters::Count count : counters->read()) {
+            count.value /= total_operations;
+            result.per_operation.push_back(count);
+        }
+    }
+    if (config.print) {
+        print_result(result);
+    }
+    if (!config.json_path.empty()) {
+        recorded_results().push_back(result);
+    }
+    return result;
+}
@@ -0,0 +1,138 @@
+// This program runs producer/consumer workloads against an instrumented
+// `Queue` and reports what the instrumentation recorded: the latency
+// distribution of each operation if `LOCK_FREE_QUEUE_LATENCY` is defined,
+// the compare-and-swap and node allocation counters if
+// `LOCK_FREE_QUEUE_STATS` is defined, and per-thread fairness if
+// `LOCK_FREE_QUEUE_FAIRNESS` is defined.
+//
+// Fairness is summarized per run as Jain's index of the producers' push
+// rates and of the consumers' pop rates, where a thread's rate is its
+// successful operations divided by the time between its first and last
+// operations. Every producer and consumer has the same amount of work, so a
+// starved thread shows up as a slow one.
+
+#include "bench.h"
+#include "lock_free_queue.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static_assert(queue_latency_enabled || queue_stats_enabled || queue_fairness_enabled,
+    "compile with -DLOCK_FREE_QUEUE_LATENCY, -DLOCK_FREE_QUEUE_STATS and/or -DLOCK_FREE_QUEUE_FAIRNESS");
+
+void print_latency(const char *operation, const LatencyHistogram& histogram) {
+    const double ticks_per_ns = tsc_per_ns();
+    const auto ns = [&](std::uint64_t ticks) { return ticks / ticks_per_ns; };
+    std::cout << "    " << std::left << std::setw(22) << operation << std::right
+              << std::fixed << std::setprecision(0)
+              << " samples=" << std::setw(9) << histogram.count()
+              << "  p50=" << std::setw(7) << ns(histogram.value_at(0.50)) << "ns"
+              << "  p99=" << std::setw(7) << ns(histogram.value_at(0.99)) << "ns"
+              << "  p99.9=" << std::setw(8) << ns(histogram.value_at(0.999)) << "ns"
+              << "  max=" << std::setw(9) << ns(histogram.max()) << "ns"
+              << std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+void print_stats(const QueueStats& stats) {
+    for (std::size_t i = 0; i < n_cas_sites; ++i) {
+        const CasSite site = CasSite(i);
+        const CasCounters& counters = stats[site];
+        std::cout << "    " << std::left << std::setw(22) << cas_site_name(site) << std::right
+                  << " attempts=" << std::setw(10) << counters.attempts
+                  << "  failures=" << std::setw(9) << counters.failures
+                  << " (" << std::fixed << std::setprecision(2)
+                  << (counters.attempts ? 100.0 * counters.failures / counters.attempts : 0.0) << "%)"
+                  << std::defaultfloat << std::setprecision(6)
+                  << "  bails=" << counters.bails << '\n';
+    }
+    const NodeCounters& nodes = stats.nodes;
+    std::cout << "    nodes: allocations=" << nodes.allocations << "  free list hits=" << nodes.free_list_hits
+              << "  misses=" << nodes.free_list_misses() << " (empty=" << nodes.free_list_empty
+              << ", busy=" << nodes.free_list_busy << ")  owned=" << nodes.owned()
+              << "  cached=" << nodes.cached() << '\n';
+}
+
+// Print Jain's index of the push and pop rates of the threads in `fairness`
+// whose first operation was at or after `since`, i.e. those of the latest
+// run.
+void print_run_fairness(int run, const QueueFairness& fairness, std::uint64_t since) {
+    std::vector<double> push_rates, pop_rates;
+    std::uint64_t longest_retry_streak = 0;
+    for (const ThreadFairness& thread : fairness.threads) {
+        if (thread.first_tsc < since) {
+            continue;
+        }
+        const double ticks = double(std::max<std::uint64_t>(1, thread.last_tsc - thread.first_tsc));
+        if (thread.push_successes) {
+            push_rates.push_back(thread.push_successes / ticks);
+        }
+        if (thread.pop_successes) {
+            pop_rates.push_back(thread.pop_successes / ticks);
+        }
+        longest_retry_streak = std::max(longest_retry_streak, thread.longest_retry_streak);
+    }
+    std::cout << "    run " << std::setw(2) << run << std::fixed << std::setprecision(3)
+              << "  Jain push=" << jain_index(push_rates) << " (" << push_rates.size() << " threads)"
+              << "  Jain pop=" << jain_index(pop_rates) << " (" << pop_rates.size() << " threads)"
+              << std::defaultfloat << std::setprecision(6)
+              << "  longest retry streak=" << longest_retry_streak << '\n';
+}
+
+// Run the `run_pairs` producer/consumer workload
+// `config.repetitions` times into one `Queue`, and then print what was
+// recorded.
+template <typename T, typename Traits = PayloadTraits<T>>
+void bench_instrumented(const BenchConfig& config) {
+    const long ops = scaled_ops(config, sizeof(T));
+    for (const std::pair<int, int>& split : producer_consumer_splits(config)) {
+        const int producers = split.first;
+        const int consumers = split.second;
+        const std::string name = std::string("Queue<") + Traits::name() + "> pairs "
+            + std::to_string(producers) + "P:" + std::to_string(consumers) + "C";
+        if (!config.selected(name)) {
+            continue;
+        }
+
+        std::cout << name << '\n';
+        Queue<T> queue;
+        for (int i = 0; i < config.repetitions; ++i) {
+            const std::uint64_t since = read_tsc();
+            run_pairs<T, Traits>(queue, producers, consumers, ops);
+            if constexpr (queue_fairness_enabled) {
+                print_run_fairness(i + 1, queue.fairness(), since);
+            }
+        }
+
+        if constexpr (queue_latency_enabled) {
+            const QueueLatency latency = queue.latency();
+            print_latency("push_back", latency.push_back);
+            print_latency("try_pop_front", latency.try_pop_front);
+            print_latency("try_pop_front (empty)", latency.try_pop_front_empty);
+        }
+        if constexpr (queue_stats_enabled) {
+            print_stats(queue.stats());
+        }
+        if constexpr (queue_fairness_enabled) {
+            LatencyHistogram time_to_success;
+            for (const ThreadFairness& thread : queue.fairness().threads) {
+                time_to_success.merge(thread.time_to_success);
+            }
+            print_latency("time to success", time_to_success);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const BenchConfig config = parse_bench_args(argc, argv);
+    if constexpr (queue_latency_enabled || queue_fairness_enabled) {
+        std::cout << "TSC ticks per ns: " << tsc_per_ns() << '\n';
+    }
+    bench_instrumented<int>(config);
+    bench_instrumented<std::string, SsoString>(config);
+    bench_instrumented<std::string, HeapString>(config);
+    bench_instrumented<Payload1K>(config);
+}
@@ -0,0 +1,472 @@
+#pragma once
+
+// This file contains the benchmark result store: writing the results that
+// `measure` recorded to a JSON file, together with fingerprints of the host
+// that produced them, and reading such files back. It also contains the
+// statistics that `compare` uses to decide whether a difference between two
+// runs is significant.
+//
+// A results file looks like this:
+//
+//     {
+//       "program": "bench",
+//       "time": "2026-01-31T12:34:56Z",
+//       "host": {"hostname": "...", "kernel": "...", "cpu": "...",
+//                "compiler": "...", "topology": "..."},
+//       "repetitions": 5,
+//       "ops_per_thread": 200000,
+//       "results": [
+//         {"name": "Queue<int>::push_back", "threads": 4,
+//          "ops_per_second": [1.2e7, ...],
+//          "per_operation": {"cycles": 123.4, ...}},
+//         ...
+//       ]
+//     }
+//
+// `ops_per_second` has one sample per repetition, so that a comparison can
+// account for noise. `per_operation` is present only if hardware counters
+// were used. A number that isn't finite, e.g. the rate of a repetition that
+// took no time, is written as `null`, and is left out when the file is read.
+
+#include "bench.h"
+#include "topology.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/utsname.h>
+
+// `HostInfo` identifies the machine and build that produced some results.
+// Results from different hosts are not comparable.
+struct HostInfo {
+    std::string hostname;
+    // Kernel release, e.g. "6.8.0-45-generic".
+    std::string kernel;
+    // CPU model name, from `/proc/cpuinfo`.
+    std::string cpu;
+    std::string compiler;
+    // See `topology_fingerprint`.
+    std::string topology;
+};
+
+inline HostInfo current_host() {
+    HostInfo host;
+    utsname names;
+    if (uname(&names) == 0) {
+        host.hostname = names.nodename;
+        host.kernel = names.release;
+    }
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuinfo, line);) {
+        const std::size_t colon = line.find(':');
+        if (line.rfind("model name", 0) == 0 && colon != std::string::npos) {
+            const std::size_t start = line.find_first_not_of(" \t", colon + 1);
+            host.cpu = start == std::string::npos ? "" : line.substr(start);
+            break;
+        }
+    }
+#if defined(__clang__)
+    host.compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+    host.compiler = "gcc " __VERSION__;
+#endif
+    host.topology = topology_fingerprint(read_topology());
+    return host;
+}
+
+// `ResultsFile` is the contents of a results file.
+struct ResultsFile {
+    std::string program;
+    std::string time;
+    HostInfo host;
+    int repetitions = 0;
+    long ops_per_thread = 0;
+    std::vector<BenchResult> results;
+};
+
+// Return `text` as a quoted JSON string.
+inline std::string json_quote(const std::string& text) {
+    std::string result = "\"";
+    for (const char ch : text) {
+        switch (ch) {
+        case '"': result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\n': result += "\\n"; break;
+        case '\t': result += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof escaped, "\\u%04x", ch);
+                result += escaped;
+            } else {
+                result += ch;
+            }
+        }
+    }
+    return result + '"';
+}
+
+// Return `value` as a JSON number, or as `null` if it isn't finite, since
+// JSON has no infinities or NaNs.
+inline std::string json_number(double value) {
+    if (!std::isfinite(value)) {
+        return "null";
+    }
+    std::ostringstream out;
+    out.precision(17);
+    out << value;
+    return out.str();
+}
+
+inline void write_results(std::ostream& out, const ResultsFile& file) {
+    const HostInfo& host = file.host;
+    out << "{\n"
+        << "  \"program\": " << json_quote(file.program) << ",\n"
+        << "  \"time\": " << json_quote(file.time) << ",\n"
+        << "  \"host\": {\"hostname\": " << json_quote(host.hostname)
+        << ", \"kernel\": " << json_quote(host.kernel)
+        << ", \"cpu\": " << json_quote(host.cpu)
+        << ", \"compiler\": " << json_quote(host.compiler)
+        << ", \"topology\": " << json_quote(host.topology) << "},\n"
+        << "  \"repetitions\": " << file.repetitions << ",\n"
+        << "  \"ops_per_thread\": " << file.ops_per_thread << ",\n"
+        << "  \"results\": [";
+    for (std::size_t i = 0; i < file.results.size(); ++i) {
+        const BenchResult& result = file.results[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"name\": " << json_quote(result.name)
+            << ", \"threads\": " << result.threads
+            << ", \"ops_per_second\": [";
+        for (std::size_t j = 0; j < result.ops_per_second.size(); ++j) {
+            out << (j ? ", " : "") << json_number(result.ops_per_second[j]);
+        }
+        out << ']';
+        if (!result.per_operation.empty()) {
+            out << ", \"per_operation\": {";
+            for (std::size_t j = 0; j < result.per_operation.size(); ++j) {
+                const PerfCounters::Count& count = result.per_operation[j];
+                out << (j ? ", " : "") << json_quote(count.name) << ": " << json_number(count.value);
+            }
+            out << '}';
+        }
+        out << '}';
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Write `recorded_results()` to `config.json_path`, if it's set, as the
+// results of `program`. Return whether that succeeded or there was nothing
+// to do. Call this at the end of a benchmark program.
+inline bool save_results(const BenchConfig& config, const std::string& program) {
+    if (config.json_path.empty()) {
+        return true;
+    }
+    ResultsFile file;
+    file.program = program;
+    char time[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(time, sizeof time, "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    file.time = time;
+    file.host = current_host();
+    file.repetitions = config.repetitions;
+    file.ops_per_thread = config.ops_per_thread;
+    file.results = recorded_results();
+
+    std::ofstream out(config.json_path);
+    write_results(out, file);
+    out.close();
+    if (!out) {
+        std::cerr << "Unable to write results to " << config.json_path << '\n';
+        return false;
+    }
+    return true;
+}
+
+// `JsonValue` is a parsed JSON value. It's only as elaborate as reading
+// results files requires.
+struct JsonValue {
+    enum Kind { null, boolean, number, string, array, object } kind = null;
+    bool boolean_value = false;
+    double number_value = 0;
+    std::string string_value;
+    std::vector<JsonValue> elements;
+    // In the order in which they appear.
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    // Return the member named `key`, or a null value if there isn't one.
+    const JsonValue& operator[](const std::string& key) const;
+};
+
+inline const JsonValue& JsonValue::operator[](const std::string& key) const {
+    static const JsonValue missing;
+    for (const auto& [name, value] : members) {
+        if (name == key) {
+            return value;
+        }
+    }
+    return missing;
+}
+
+// `JsonParser` parses one JSON document, throwing `std::runtime_error` if
+// it's malformed.
+class JsonParser {
+    const std::string& text;
+    std::size_t i = 0;
+
+public:
+    explicit JsonParser(const std::string& text)
+    : text(text) {}
+
+    JsonValue parse();
+
+private:
+    JsonValue value();
+    std::string string();
+    void skip_space();
+    void expect(char ch);
+    bool consume(const char *literal);
+    [[noreturn]] void fail(const char *why) const;
+};
+
+inline JsonValue JsonParser::parse() {
+    JsonValue result = value();
+    skip_space();
+    if (i != text.size()) {
+        fail("trailing characters");
+    }
+    return result;
+}
+
+inline JsonValue JsonParser::value() {
+    skip_space();
+    JsonValue result;
+    if (i == text.size()) {
+        fail("unexpected end");
+    }
+    const char ch = text[i];
+    if (ch == '{') {
+        result.kind = JsonValue::object;
+        ++i;
+        skip_space();
+        if (consume("}")) {
+            return result;
+        }
+        do {
+            skip_space();
+            const std::string key = string();
+            expect(':');
+            result.members.emplace_back(key, value());
+            skip_space();
+        } while (consume(","));
+        expect('}');
+    } else if (ch == '[') {
+        result.kind = JsonValue::array;
+        ++i;
+        skip_space();
+        if (consume("]")) {
+            return result;
+        }
+        do {
+            result.elements.push_back(value());
+            skip_space();
+        } while (consume(","));
+        expect(']');
+    } else if (ch == '"') {
+        result.kind = JsonValue::string;
+        result.string_value = string();
+    } else if (consume("true")) {
+        result.kind = JsonValue::boolean;
+        result.boolean_value = true;
+    } else if (consume("false")) {
+        result.kind = JsonValue::boolean;
+    } else if (consume("null")) {
+        result.kind = JsonValue::null;
+    } else {
+        char *end;
+        result.number_value = std::strtod(text.c_str() + i, &end);
+        if (end == text.c_str() + i) {
+            fail("unexpected character");
+        }
+        result.kind = JsonValue::number;
+        i = end - text.c_str();
+    }
+    return result;
+}
+
+inline std::string JsonParser::string() {
+    expect('"');
+    std::string result;
+    while (i < text.size() && text[i] != '"') {
+        char ch = text[i++];
+        if (ch == '\\') {
+            if (i == text.size()) {
+                break;
+            }
+            switch (ch = text[i++]) {
+            case 'n': ch = '\n'; break;
+            case 't': ch = '\t'; break;
+            case 'r': ch = '\r'; break;
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'u':
+                // Only the control characters that `json_quote` escapes
+                // are expected, so keep the low byte.
+                if (i + 4 > text.size()) {
+                    fail("truncated escape");
+                }
+                ch = char(std::stoi(text.substr(i, 4), nullptr, 16));
+                i += 4;
+                break;
+            }
+        }
+        result += ch;
+    }
+    expect('"');
+    return result;
+}
+
+inline void JsonParser::skip_space() {
+    while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) {
+        ++i;
+    }
+}
+
+inline void JsonParser::expect(char ch) {
+    skip_space();
+    if (i == text.size() || text[i] != ch) {
+        fail("unexpected character");
+    }
+    ++i;
+}
+
+inline bool JsonParser::consume(const char *literal) {
+    const std::size_t length = std::char_traits<char>::length(literal);
+    if (text.compare(i, length, literal) != 0) {
+        return false;
+    }
+    i += length;
+    return true;
+}
+
+inline void JsonParser::fail(const char *why) const {
+    throw std::runtime_error(std::string("JSON: ") + why + " at offset " + std::to_string(i));
+}
+
+// Read the results file at `path`. Throw `std::runtime_error` if it can't be
+// read or parsed.
+inline ResultsFile read_results(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("unable to open " + path);
+    }
+    const std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    JsonValue json;
+    try {
+        json = JsonParser(text).parse();
+    } catch (const std::runtime_error& error) {
+        throw std::runtime_error(path + ": " + error.what());
+    }
+
+    ResultsFile file;
+    file.program = json["program"].string_value;
+    file.time = json["time"].string_value;
+    const JsonValue& host = json["host"];
+    file.host = HostInfo{host["hostname"].string_value, host["kernel"].string_value, host["cpu"].string_value,
+        host["compiler"].string_value, host["topology"].string_value};
+    file.repetitions = int(json["repetitions"].number_value);
+    file.ops_per_thread = long(json["ops_per_thread"].number_value);
+    for (const JsonValue& element : json["results"].elements) {
+        BenchResult result{element["name"].string_value, int(element["threads"].number_value), {}, {}};
+        for (const JsonValue& sample : element["ops_per_second"].elements) {
+            if (sample.kind == JsonValue::number) {
+                result.ops_per_second.push_back(sample.number_value);
+            }
+        }
+        for (const auto& [name, value] : element["per_operation"].members) {
+            if (value.kind == JsonValue::number) {
+                result.per_operation.push_back(PerfCounters::Count{name, value.number_value});
+            }
+        }
+        file.results.push_back(std::move(result));
+    }
+    return file;
+}
+
+// Return the regularized incomplete beta function I_x(a, b), by the
+// continued fraction in Numerical Recipes, section 6.4.
+inline double incomplete_beta(double x, double a, double b) {
+    if (x <= 0) {
+        return 0;
+    }
+    if (x >= 1) {
+        return 1;
+    }
+    // The continued fraction converges quickly only for x < (a + 1) / (a + b + 2).
+    if (x > (a + 1) / (a + b + 2)) {
+        return 1 - incomplete_beta(1 - x, b, a);
+    }
+    const double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b)
+        + a * std::log(x) + b * std::log(1 - x)) / a;
+    // Lentz's method
+    const double tiny = 1e-300;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    d = 1 / (std::fabs(d) < tiny ? tiny : d);
+    double f = d;
+    for (int m = 1; m <= 200; ++m) {
+        for (const double numerator : {
+                 m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m)),
+                 -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))}) {
+            d = 1 + numerator * d;
+            d = 1 / (std::fabs(d) < tiny ? tiny : d);
+            c = 1 + numerator / c;
+            c = std::fabs(c) < tiny ? tiny : c;
+            f *= c * d;
+        }
+        if (std::fabs(c * d - 1) < 1e-12) {
+            break;
+        }
+    }
+    return front * f;
+}
+
+// Return the two-sided p-value of Welch's t-test for whether the samples
+// `left` and `right` have different means. Return 1 if either has fewer
+// than two samples, since then there's no estimate of the variance.
+inline double welch_p_value(const std::vector<double>& left, const std::vector<double>& right) {
+    const std::size_t n1 = left.size(), n2 = right.size();
+    if (n1 < 2 || n2 < 2) {
+        return 1;
+    }
+    const auto moments = [](const std::vector<double>& samples, double& mean, double& variance) {
+        mean = 0;
+        for (const double value : samples) {
+            mean += value;
+        }
+        mean /= samples.size();
+        variance = 0;
+        for (const double value : samples) {
+            variance += (value - mean) * (value - mean);
+        }
+        variance /= samples.size() - 1;
+    };
+    double mean1, variance1, mean2, variance2;
+    moments(left, mean1, variance1);
+    moments(right, mean2, variance2);
+    const double v1 = variance1 / n1, v2 = variance2 / n2;
+    if (v1 + v2 == 0) {
+        return mean1 == mean2 ? 1 : 0;
+    }
+    const double t = (mean1 - mean2) / std::sqrt(v1 + v2);
+    const double degrees_of_freedom = (v1 + v2) * (v1 + v2) / (v1 * v1 / (n1 - 1) + v2 * v2 / (n2 - 1));
+    return incomplete_beta(degrees_of_freedom / (degrees_of_freedom + t * t), degrees_of_freedom / 2, 0.5);
+}
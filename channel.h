@@ -0,0 +1,313 @@
+#pragma once
+
+// This file contains `make_channel`, which returns the two ends of a queue
+// as separate handles: a `Sender`, which can only push, and a `Receiver`,
+// which can only pop. The channel counts the handles at each end, so a
+// receiver can tell "empty for now" from "empty for good": once every sender
+// is gone and the queue is drained, receiving reports that the channel is
+// closed. Likewise, sending fails once every receiver is gone. Consumers can
+// then shut down without a "poison pill" element.
+//
+// Whether each end's handles can be copied is a template parameter, and it
+// determines which queue the channel uses: a channel with one sender and one
+// receiver uses `SpscQueue`, and any other channel uses `Queue`.
+
+#include "futex.h"
+#include "lock_free_queue.h"
+#include "spsc_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+enum class ChannelStatus {
+    // An element was received.
+    ready,
+    // The channel is empty, but a sender might still send.
+    empty,
+    // The channel is empty, and every sender is gone.
+    closed
+};
+
+// `Received<T>` is the result of trying to receive a `T`. Its `value` is set
+// exactly when its `status` is `ready`.
+template <typename T>
+struct Received {
+    ChannelStatus status;
+    std::optional<T> value;
+
+    explicit operator bool() const {
+        return status == ChannelStatus::ready;
+    }
+};
+
+// `ChannelState<T, Engine>` is what a channel's handles share.
+template <typename T, typename Engine>
+struct ChannelState {
+    Engine queue;
+    std::atomic<std::size_t> n_senders;
+    std::atomic<std::size_t> n_receivers;
+    // Receivers sleep on this. Senders notify it after each push, and the
+    // last sender notifies it on leaving.
+    EventCount not_empty;
+
+    ChannelState()
+    : n_senders(1)
+    , n_receivers(1) {}
+
+    Received<T> try_receive();
+};
+
+template <typename T, typename Engine>
+Received<T> ChannelState<T, Engine>::try_receive() {
+    if (std::optional<T> value = queue.try_pop_front()) {
+        return {ChannelStatus::ready, std::move(value)};
+    }
+    if (n_senders.load()) {
+        return {ChannelStatus::empty, std::nullopt};
+    }
+    // Every sender pushed before it left, so now that they've all left, the
+    // queue has everything it will ever have.
+    if (std::optional<T> value = queue.try_pop_front()) {
+        return {ChannelStatus::ready, std::move(value)};
+    }
+    return {ChannelStatus::closed, std::nullopt};
+}
+
+// `ChannelEngine<T, many_senders, many_receivers>` is the queue used by a
+// channel with those kinds of handles.
+template <typename T, bool many_senders, bool many_receivers>
+using ChannelEngine = std::conditional_t<many_senders || many_receivers, Queue<T>, SpscQueue<T>>;
+
+// `Sender<T, copyable, Engine>` is the pushing end of a channel. It can be
+// copied only if `copyable`. A moved-from sender refers to no channel, and
+// may only be destroyed or assigned to.
+template <typename T, bool copyable, typename Engine>
+class Sender {
+    std::shared_ptr<ChannelState<T, Engine>> state;
+
+public:
+    explicit Sender(std::shared_ptr<ChannelState<T, Engine>> state);
+    Sender(const Sender& other) requires (copyable);
+    Sender(Sender&& other) noexcept;
+    ~Sender();
+
+    Sender& operator=(const Sender& other) requires (copyable);
+    Sender& operator=(Sender&& other) noexcept;
+
+    // Push `value` and return `true`, unless every receiver is gone, in which
+    // case return `false` and leave `value` alone.
+    template <typename Value>
+    bool send(Value&& value);
+
+    // Return whether every receiver is gone.
+    bool closed() const;
+
+private:
+    void leave();
+};
+
+// `Receiver<T, copyable, Engine>` is the popping end of a channel. It can be
+// copied only if `copyable`. A moved-from receiver refers to no channel, and
+// may only be destroyed or assigned to.
+template <typename T, bool copyable, typename Engine>
+class Receiver {
+    std::shared_ptr<ChannelState<T, Engine>> state;
+
+public:
+    explicit Receiver(std::shared_ptr<ChannelState<T, Engine>> state);
+    Receiver(const Receiver& other) requires (copyable);
+    Receiver(Receiver&& other) noexcept;
+    ~Receiver();
+
+    Receiver& operator=(const Receiver& other) requires (copyable);
+    Receiver& operator=(Receiver&& other) noexcept;
+
+    // Pop the front element if there is one, without waiting.
+    Received<T> try_receive();
+
+    // Pop the front element, sleeping until there is one. Return null if the
+    // channel is closed instead.
+    std::optional<T> receive();
+
+    // Like `receive`, but give up after `timeout`, returning `empty`.
+    template <typename Rep, typename Period>
+    Received<T> receive_for(const std::chrono::duration<Rep, Period>& timeout);
+
+private:
+    void leave();
+};
+
+// `Channel<T, many_senders, many_receivers>` is the pair of handles returned
+// by `make_channel`.
+template <typename T, bool many_senders, bool many_receivers>
+struct Channel {
+    using Engine = ChannelEngine<T, many_senders, many_receivers>;
+
+    Sender<T, many_senders, Engine> sender;
+    Receiver<T, many_receivers, Engine> receiver;
+};
+
+// Return a new channel. By default both ends can be copied, so any number of
+// threads can send and receive. Pass `false` for an end to make its handle
+// move-only, which promises that at most one thread uses that end at a time.
+// Both `false` gives a single-producer single-consumer channel.
+template <typename T, bool many_senders = true, bool many_receivers = true>
+Channel<T, many_senders, many_receivers> make_channel() {
+    using Engine = ChannelEngine<T, many_senders, many_receivers>;
+    const auto state = std::make_shared<ChannelState<T, Engine>>();
+    return {Sender<T, many_senders, Engine>(state), Receiver<T, many_receivers, Engine>(state)};
+}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>::Sender(std::shared_ptr<ChannelState<T, Engine>> state)
+: state(std::move(state)) {}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>::Sender(const Sender& other) requires (copyable)
+: state(other.state) {
+    if (state) {
+        state->n_senders.fetch_add(1);
+    }
+}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>::Sender(Sender&& other) noexcept
+: state(std::move(other.state)) {}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>::~Sender() {
+    leave();
+}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>& Sender<T, copyable, Engine>::operator=(const Sender& other) requires (copyable) {
+    return *this = Sender(other);
+}
+
+template <typename T, bool copyable, typename Engine>
+Sender<T, copyable, Engine>& Sender<T, copyable, Engine>::operator=(Sender&& other) noexcept {
+    if (this != &other) {
+        leave();
+        state = std::move(other.state);
+    }
+    return *this;
+}
+
+template <typename T, bool copyable, typename Engine>
+template <typename Value>
+bool Sender<T, copyable, Engine>::send(Value&& value) {
+    if (!state->n_receivers.load()) {
+        return false;
+    }
+    state->queue.push_back(std::forward<Value>(value));
+    state->not_empty.notify_one();
+    return true;
+}
+
+template <typename T, bool copyable, typename Engine>
+bool Sender<T, copyable, Engine>::closed() const {
+    return !state->n_receivers.load();
+}
+
+template <typename T, bool copyable, typename Engine>
+void Sender<T, copyable, Engine>::leave() {
+    if (state && state->n_senders.fetch_sub(1) == 1) {
+        // Wake every receiver, so that each sees that the channel is closed.
+        state->not_empty.notify_all();
+    }
+    state.reset();
+}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>::Receiver(std::shared_ptr<ChannelState<T, Engine>> state)
+: state(std::move(state)) {}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>::Receiver(const Receiver& other) requires (copyable)
+: state(other.state) {
+    if (state) {
+        state->n_receivers.fetch_add(1);
+    }
+}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>::Receiver(Receiver&& other) noexcept
+: state(std::move(other.state)) {}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>::~Receiver() {
+    leave();
+}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>& Receiver<T, copyable, Engine>::operator=(const Receiver& other) requires (copyable) {
+    return *this = Receiver(other);
+}
+
+template <typename T, bool copyable, typename Engine>
+Receiver<T, copyable, Engine>& Receiver<T, copyable, Engine>::operator=(Receiver&& other) noexcept {
+    if (this != &other) {
+        leave();
+        state = std::move(other.state);
+    }
+    return *this;
+}
+
+template <typename T, bool copyable, typename Engine>
+Received<T> Receiver<T, copyable, Engine>::try_receive() {
+    return state->try_receive();
+}
+
+template <typename T, bool copyable, typename Engine>
+std::optional<T> Receiver<T, copyable, Engine>::receive() {
+    for (;;) {
+        Received<T> received = state->try_receive();
+        if (received.status != ChannelStatus::empty) {
+            return std::move(received.value);
+        }
+        const EventCount::Key key = state->not_empty.prepare_wait();
+        received = state->try_receive();
+        if (received.status != ChannelStatus::empty) {
+            state->not_empty.cancel_wait();
+            return std::move(received.value);
+        }
+        state->not_empty.wait(key);
+    }
+}
+
+template <typename T, bool copyable, typename Engine>
+template <typename Rep, typename Period>
+Received<T> Receiver<T, copyable, Engine>::receive_for(const std::chrono::duration<Rep, Period>& timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+        Received<T> received = state->try_receive();
+        if (received.status != ChannelStatus::empty) {
+            return received;
+        }
+        const EventCount::Key key = state->not_empty.prepare_wait();
+        received = state->try_receive();
+        if (received.status != ChannelStatus::empty) {
+            state->not_empty.cancel_wait();
+            return received;
+        }
+        const auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero()) {
+            state->not_empty.cancel_wait();
+            return received;
+        }
+        state->not_empty.wait_for(key, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+    }
+}
+
+template <typename T, bool copyable, typename Engine>
+void Receiver<T, copyable, Engine>::leave() {
+    if (state) {
+        state->n_receivers.fetch_sub(1);
+    }
+    state.reset();
+}
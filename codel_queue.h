@@ -0,0 +1,225 @@
+#pragma once
+
+// This file contains `CoDelQueue`, a wrapper around a queue that stamps each
+// element with the time it was pushed, so that consumers can see how long
+// each element waited (its "sojourn time"), and that drops elements that
+// waited too long, so that under overload the queueing delay stays bounded
+// instead of the queue growing without limit.
+//
+// Dropping follows CoDel ("controlled delay," Nichols & Jacobson, RFC 8289).
+// Sojourn times below `target` are fine. Once they've stayed above `target`
+// for a whole `interval`, the consumer drops an element, and then keeps
+// dropping one element every `interval / sqrt(count)`, where `count` is the
+// number of drops so far, until a sojourn time falls below `target` again.
+// A queue that is merely bursty drains before `interval` elapses and loses
+// nothing, while one that is persistently overloaded sheds load at an
+// increasing rate until its delay comes back down.
+//
+// Optionally, a `deadline` can be set as well, and any element that waited
+// longer than that is dropped regardless of CoDel's state.
+//
+// Dropped elements are passed to a handler, if one was given, which can
+// divert them elsewhere instead of destroying them.
+
+#include "lock_free_queue.h"
+#include "per_thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <utility>
+
+struct CoDelParams {
+    // The acceptable standing sojourn time.
+    std::chrono::nanoseconds target = std::chrono::milliseconds(5);
+    // How long sojourn times must stay above `target` before dropping
+    // begins. This is also the initial time between drops.
+    std::chrono::nanoseconds interval = std::chrono::milliseconds(100);
+    // If positive, the most any element may wait before it's dropped.
+    std::chrono::nanoseconds deadline = std::chrono::nanoseconds(0);
+};
+
+// `CoDelQueue<T, Q>` has the same interface as `Q<T>`, plus a
+// `try_pop_front` overload that reports the sojourn time of the popped
+// element. Each element is stored in `Q` alongside its push time, which
+// costs a clock read per push and per pop.
+//
+// CoDel's state is kept per consumer thread, so that consumers share nothing
+// but the queue. Each consumer runs the control law on the sojourn times of
+// the elements it pops. Since those all reflect the same queue, the
+// consumers agree about when to start and stop dropping, but each drops at
+// its own rate, so the total drop rate scales with the number of consumers.
+// RFC 8289 also declines to drop when less than a packet's worth is queued;
+// `Q` needn't be able to tell, so this doesn't.
+template <typename T, template <typename> class Q = Queue>
+class CoDelQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Called with each dropped element and how long it waited, on the thread
+    // that dropped it.
+    using DropHandler = std::function<void(T&&, std::chrono::nanoseconds)>;
+
+private:
+    struct Stamped {
+        Clock::time_point pushed;
+        T value;
+    };
+
+    struct State {
+        // When sojourn times will have been above `target` for an
+        // `interval`, or `Clock::time_point()` if they're below `target`.
+        Clock::time_point first_above_time;
+        // When to drop next, while `dropping`.
+        Clock::time_point drop_next;
+        std::uint32_t count = 0;
+        std::uint32_t last_count = 0;
+        bool dropping = false;
+        std::atomic<std::uint64_t> dropped = 0;
+    };
+
+    struct Popped {
+        std::optional<Stamped> element;
+        std::chrono::nanoseconds sojourn;
+        bool ok_to_drop;
+    };
+
+    Q<Stamped> queue;
+    const CoDelParams params;
+    const DropHandler on_drop;
+    PerThread<State> states;
+
+public:
+    template <typename... Args>
+    explicit CoDelQueue(CoDelParams params = {}, DropHandler on_drop = {}, Args&&... queue_args);
+
+    template <typename Value>
+    void push_back(Value&& value);
+    std::optional<T> try_pop_front();
+    // Like `try_pop_front()`, and if an element is returned, also set
+    // `sojourn` to how long it waited in the queue.
+    std::optional<T> try_pop_front(std::chrono::nanoseconds& sojourn);
+
+    // Return the number of elements dropped so far, summed over all threads.
+    std::uint64_t dropped() const;
+
+private:
+    // Pop an element, dropping any that are past the deadline, and update
+    // `state.first_above_time` with its sojourn time as of `now`.
+    Popped pop(State& state, Clock::time_point now);
+    void drop(State& state, Popped& popped);
+    Clock::time_point control_law(Clock::time_point from, std::uint32_t count) const;
+};
+
+template <typename T, template <typename> class Q>
+template <typename... Args>
+CoDelQueue<T, Q>::CoDelQueue(CoDelParams params, DropHandler on_drop, Args&&... queue_args)
+: queue(std::forward<Args>(queue_args)...)
+, params(params)
+, on_drop(std::move(on_drop)) {}
+
+template <typename T, template <typename> class Q>
+template <typename Value>
+void CoDelQueue<T, Q>::push_back(Value&& value) {
+    queue.push_back(Stamped{Clock::now(), T(std::forward<Value>(value))});
+}
+
+template <typename T, template <typename> class Q>
+std::optional<T> CoDelQueue<T, Q>::try_pop_front() {
+    std::chrono::nanoseconds sojourn;
+    return try_pop_front(sojourn);
+}
+
+template <typename T, template <typename> class Q>
+std::optional<T> CoDelQueue<T, Q>::try_pop_front(std::chrono::nanoseconds& sojourn) {
+    State& state = states.local();
+    const Clock::time_point now = Clock::now();
+    Popped popped = pop(state, now);
+
+    if (state.dropping) {
+        if (!popped.ok_to_drop) {
+            // Sojourn times are back below `target`.
+            state.dropping = false;
+        }
+        while (state.dropping && now >= state.drop_next) {
+            drop(state, popped);
+            ++state.count;
+            popped = pop(state, now);
+            if (!popped.ok_to_drop) {
+                state.dropping = false;
+            } else {
+                state.drop_next = control_law(state.drop_next, state.count);
+            }
+        }
+    } else if (popped.ok_to_drop) {
+        drop(state, popped);
+        popped = pop(state, now);
+        state.dropping = true;
+        // If dropping stopped only recently, then resume at about the rate
+        // it had reached, rather than starting over.
+        const std::uint32_t delta = state.count - state.last_count;
+        state.count = delta > 1 && now - state.drop_next < 16 * params.interval ? delta : 1;
+        state.drop_next = control_law(now, state.count);
+        state.last_count = state.count;
+    }
+
+    if (!popped.element) {
+        return std::nullopt;
+    }
+    sojourn = popped.sojourn;
+    return std::move(popped.element->value);
+}
+
+template <typename T, template <typename> class Q>
+std::uint64_t CoDelQueue<T, Q>::dropped() const {
+    std::uint64_t total = 0;
+    states.for_each([&](const State& state) {
+        total += state.dropped.load(std::memory_order_relaxed);
+    });
+    return total;
+}
+
+template <typename T, template <typename> class Q>
+typename CoDelQueue<T, Q>::Popped CoDelQueue<T, Q>::pop(State& state, Clock::time_point now) {
+    for (;;) {
+        Popped popped{queue.try_pop_front(), std::chrono::nanoseconds(0), false};
+        if (!popped.element) {
+            state.first_above_time = Clock::time_point();
+            return popped;
+        }
+        // The element might have been pushed after `now` was read.
+        popped.sojourn = std::max(std::chrono::nanoseconds(0),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - popped.element->pushed));
+        if (params.deadline.count() > 0 && popped.sojourn > params.deadline) {
+            drop(state, popped);
+            continue;
+        }
+
+        if (popped.sojourn < params.target) {
+            state.first_above_time = Clock::time_point();
+        } else if (state.first_above_time == Clock::time_point()) {
+            state.first_above_time = now + params.interval;
+        } else if (now >= state.first_above_time) {
+            popped.ok_to_drop = true;
+        }
+        return popped;
+    }
+}
+
+template <typename T, template <typename> class Q>
+void CoDelQueue<T, Q>::drop(State& state, Popped& popped) {
+    bump(state.dropped);
+    if (on_drop) {
+        on_drop(std::move(popped.element->value), popped.sojourn);
+    }
+    popped.element.reset();
+}
+
+template <typename T, template <typename> class Q>
+typename CoDelQueue<T, Q>::Clock::time_point CoDelQueue<T, Q>::control_law(Clock::time_point from,
+                                                                          std::uint32_t count) const {
+    return from + std::chrono::nanoseconds(std::int64_t(params.interval.count() / std::sqrt(double(count))));
+}
@@ -0,0 +1,140 @@
+// This program compares a benchmark run against a baseline run, both
+// written by a benchmark program's `--json` option, and lists the cells
+// (benchmark name and thread count) whose throughput changed.
+//
+// A cell has regressed if its mean throughput fell by more than
+// `--threshold` percent and Welch's t-test on the per-repetition samples
+// says that the difference is significant at level `--alpha`. Both
+// conditions are needed: the first ignores differences too small to matter,
+// and the second ignores differences that are within the noise. Cells that
+// improved by the same criteria are listed too.
+//
+// The program exits with status 1 if any cell regressed, so that it can be
+// used as a performance gate, and with status 2 on usage or input errors.
+// It warns if the two runs came from different hosts or configurations,
+// since then the comparison means little.
+
+#include "bench_results.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct CompareConfig {
+    std::string baseline_path;
+    std::string candidate_path;
+    // Smallest change in mean throughput, in percent, that counts.
+    double threshold_percent = 5;
+    // Significance level of the t-test.
+    double alpha = 0.05;
+    // Whether to list unchanged cells as well.
+    bool all = false;
+};
+
+CompareConfig parse_args(int argc, char *argv[]) {
+    CompareConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--threshold PERCENT] [--alpha LEVEL] [--all] BASELINE.json CANDIDATE.json\n";
+        std::exit(2);
+    };
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--threshold" && i + 1 < argc) {
+            config.threshold_percent = std::atof(argv[++i]);
+        } else if (arg == "--alpha" && i + 1 < argc) {
+            config.alpha = std::atof(argv[++i]);
+        } else if (arg == "--all") {
+            config.all = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            usage();
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        usage();
+    }
+    config.baseline_path = paths[0];
+    config.candidate_path = paths[1];
+    return config;
+}
+
+void warn_if_different(const char *what, const std::string& baseline, const std::string& candidate) {
+    if (baseline != candidate) {
+        std::cerr << "warning: " << what << " differs: baseline \"" << baseline
+                  << "\", candidate \"" << candidate << "\"\n";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const CompareConfig config = parse_args(argc, argv);
+    ResultsFile baseline, candidate;
+    try {
+        baseline = read_results(config.baseline_path);
+        candidate = read_results(config.candidate_path);
+    } catch (const std::runtime_error& error) {
+        std::cerr << error.what() << '\n';
+        return 2;
+    }
+
+    warn_if_different("program", baseline.program, candidate.program);
+    warn_if_different("hostname", baseline.host.hostname, candidate.host.hostname);
+    warn_if_different("kernel", baseline.host.kernel, candidate.host.kernel);
+    warn_if_different("CPU", baseline.host.cpu, candidate.host.cpu);
+    warn_if_different("compiler", baseline.host.compiler, candidate.host.compiler);
+    warn_if_different("topology", baseline.host.topology, candidate.host.topology);
+    warn_if_different("ops per thread", std::to_string(baseline.ops_per_thread),
+        std::to_string(candidate.ops_per_thread));
+
+    std::cout << std::left << std::setw(48) << "benchmark" << std::right << std::setw(8) << "threads"
+              << std::setw(16) << "baseline ops/s" << std::setw(16) << "candidate ops/s"
+              << std::setw(10) << "change" << std::setw(10) << "p" << "  verdict\n";
+
+    int n_regressed = 0, n_improved = 0, n_compared = 0;
+    for (const BenchResult& after : candidate.results) {
+        const BenchResult *before = nullptr;
+        for (const BenchResult& result : baseline.results) {
+            if (result.name == after.name && result.threads == after.threads) {
+                before = &result;
+                break;
+            }
+        }
+        if (!before || before->ops_per_second.empty() || after.ops_per_second.empty()) {
+            continue;
+        }
+        ++n_compared;
+
+        const double change = 100 * (after.mean() - before->mean()) / before->mean();
+        const double p = welch_p_value(before->ops_per_second, after.ops_per_second);
+        const bool significant = p < config.alpha;
+        const char *verdict = "";
+        if (significant && change < -config.threshold_percent) {
+            verdict = "REGRESSED";
+            ++n_regressed;
+        } else if (significant && change > config.threshold_percent) {
+            verdict = "improved";
+            ++n_improved;
+        } else if (!config.all) {
+            continue;
+        }
+        std::cout << std::left << std::setw(48) << after.name << std::right << std::setw(8) << after.threads
+                  << std::fixed << std::setprecision(0)
+                  << std::setw(16) << before->mean() << std::setw(16) << after.mean()
+                  << std::setprecision(1) << std::setw(9) << std::showpos << change << std::noshowpos << '%'
+                  << std::setprecision(4) << std::setw(10) << p
+                  << std::defaultfloat << std::setprecision(6) << "  " << verdict << '\n';
+    }
+
+    std::cout << n_compared << " cells compared, " << n_regressed << " regressed, "
+              << n_improved << " improved (threshold " << config.threshold_percent
+              << "%, alpha " << config.alpha << ")\n";
+    if (n_compared < int(candidate.results.size()) || n_compared < int(baseline.results.size())) {
+        std::cerr << "warning: some cells are in only one of the runs\n";
+    }
+    return n_regressed ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+// This program measures what consumers' waiting costs in CPU time, for each
+// way a consumer can wait for an empty queue to become non-empty:
+//
+// - spin: call `try_pop_front` in a loop, as `test.cpp` does.
+// - spin-then-yield: spin `--spin` times, then yield the CPU between tries.
+// - park: spin `--spin` times, then sleep on a futex (see `EventCount` in
+//   `futex.h`) until a producer notifies after pushing.
+//
+// Producers push at a fixed total rate (`--rate` elements per second, or as
+// fast as possible if it's zero). Between batches they sleep rather than
+// spin, so that their own CPU time is small.
+//
+// For each strategy, the program reports the process's CPU time (user plus
+// system, from `getrusage`) per million elements, the voluntary and
+// involuntary context switches, and the consumers' utilization: the CPU time
+// their threads used, as a fraction of the wall time of the cores they
+// occupied. A consumer that does nothing but wait would ideally use none.
+
+#include "bench.h"
+#include "futex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+enum class WaitStrategy {
+    spin,
+    spin_then_yield,
+    park
+};
+
+const char *wait_strategy_name(WaitStrategy strategy) {
+    switch (strategy) {
+    case WaitStrategy::spin: return "spin";
+    case WaitStrategy::spin_then_yield: return "spin-then-yield";
+    case WaitStrategy::park: return "park";
+    }
+    return "?";
+}
+
+struct CpuCostConfig {
+    // Elements per second, summed over producers. Zero means unpaced.
+    double rate = 200'000;
+    long ops_per_producer = 200'000;
+    int producers = 1;
+    int consumers = 2;
+    // Failed pops before yielding or parking.
+    int spin = 100;
+    // Name of the engine to measure, or "all".
+    std::string engine = "Queue";
+};
+
+CpuCostConfig parse_args(int argc, char *argv[]) {
+    CpuCostConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--rate N] [--ops N] [--producers N] [--consumers N] [--spin N] [ENGINE | all]\n";
+        std::exit(2);
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--rate" && i + 1 < argc) {
+            config.rate = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--ops" && i + 1 < argc) {
+            config.ops_per_producer = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--producers" && i + 1 < argc) {
+            config.producers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--consumers" && i + 1 < argc) {
+            config.consumers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--spin" && i + 1 < argc) {
+            config.spin = std::max(0, std::atoi(argv[++i]));
+        } else if (arg.rfind("--", 0) == 0) {
+            usage();
+        } else {
+            config.engine = arg;
+        }
+    }
+    if (!selects_engine(config.engine)) {
+        std::cerr << "unknown engine: " << config.engine << '\n';
+        usage();
+    }
+    return config;
+}
+
+double thread_cpu_seconds() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct Usage {
+    double cpu_seconds;
+    long voluntary_switches;
+    long involuntary_switches;
+};
+
+Usage process_usage() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const auto seconds = [](const timeval& time) { return time.tv_sec + time.tv_usec / 1e6; };
+    return Usage{seconds(usage.ru_utime) + seconds(usage.ru_stime), usage.ru_nvcsw, usage.ru_nivcsw};
+}
+
+struct CostResult {
+    double seconds;
+    double elements;
+    Usage usage;
+    double consumer_cpu_seconds;
+};
+
+template <typename SomeQueue>
+CostResult run_cost(SomeQueue& queue, const CpuCostConfig& config, WaitStrategy strategy) {
+    using Clock = std::chrono::steady_clock;
+    const long total = config.ops_per_producer * config.producers;
+    const double per_producer_rate = config.rate / config.producers;
+    EventCount events;
+    std::vector<double> consumer_cpu(config.consumers);
+
+    const Usage before = process_usage();
+    const double seconds = run_threads(config.producers + config.consumers, [&](int i) {
+        if (i < config.producers) {
+            const auto start = Clock::now();
+            for (long j = 0; j < config.ops_per_producer;) {
+                // Push everything that's due, then sleep until the next one is.
+                long due = config.ops_per_producer;
+                if (per_producer_rate > 0) {
+                    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+                    due = std::min(due, long(elapsed * per_producer_rate) + 1);
+                }
+                for (; j < due; ++j) {
+                    queue.push_back(int(j));
+                    if (strategy == WaitStrategy::park) {
+                        events.notify_one();
+                    }
+                }
+                if (j < config.ops_per_producer) {
+                    std::this_thread::sleep_until(start + std::chrono::duration<double>(j / per_producer_rate));
+                }
+            }
+            return;
+        }
+
+        const int consumer = i - config.producers;
+        const long quota = total / config.consumers + (consumer < total % config.consumers);
+        const double cpu_before = thread_cpu_seconds();
+        int failures = 0;
+        for (long popped = 0; popped < quota;) {
+            if (const std::optional<int> element = queue.try_pop_front()) {
+                do_not_optimize(*element);
+                ++popped;
+                failures = 0;
+                continue;
+            }
+            if (strategy == WaitStrategy::spin || ++failures <= config.spin) {
+                continue;
+            }
+            if (strategy == WaitStrategy::spin_then_yield) {
+                std::this_thread::yield();
+                continue;
+            }
+            const EventCount::Key key = events.prepare_wait();
+            if (const std::optional<int> element = queue.try_pop_front()) {
+                events.cancel_wait();
+                do_not_optimize(*element);
+                ++popped;
+                failures = 0;
+                continue;
+            }
+            events.wait(key);
+        }
+        consumer_cpu[consumer] = thread_cpu_seconds() - cpu_before;
+    });
+    const Usage after = process_usage();
+
+    CostResult result{seconds, double(total), {}, 0};
+    result.usage.cpu_seconds = after.cpu_seconds - before.cpu_seconds;
+    result.usage.voluntary_switches = after.voluntary_switches - before.voluntary_switches;
+    result.usage.involuntary_switches = after.involuntary_switches - before.involuntary_switches;
+    for (const double cpu : consumer_cpu) {
+        result.consumer_cpu_seconds += cpu;
+    }
+    return result;
+}
+
+template <template <typename> class Q>
+void measure_costs(const CpuCostConfig& config) {
+    std::cout << EngineTraits<Q>::name << ": " << config.producers << " producer(s), "
+              << config.consumers << " consumer(s), ";
+    if (config.rate > 0) {
+        std::cout << config.rate << " elements/s\n";
+    } else {
+        std::cout << "unpaced\n";
+    }
+    std::cout << std::left << std::setw(18) << "strategy" << std::right
+              << std::setw(10) << "Mop/s" << std::setw(14) << "CPU s/Mop"
+              << std::setw(14) << "consumer util" << std::setw(12) << "vol csw" << std::setw(12) << "invol csw"
+              << '\n';
+    for (const WaitStrategy strategy : {WaitStrategy::spin, WaitStrategy::spin_then_yield, WaitStrategy::park}) {
+        const auto queue = EngineTraits<Q>::template make<int>(1 << 16);
+        const CostResult result = run_cost(*queue, config, strategy);
+        const double mops = result.elements / 1e6;
+        std::cout << std::left << std::setw(18) << wait_strategy_name(strategy) << std::right
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(10) << mops / result.seconds
+                  << std::setw(14) << result.usage.cpu_seconds / mops
+                  << std::setprecision(1)
+                  << std::setw(13) << 100 * result.consumer_cpu_seconds / (config.consumers * result.seconds) << '%'
+                  << std::setw(12) << result.usage.voluntary_switches
+                  << std::setw(12) << result.usage.involuntary_switches
+                  << std::defaultfloat << std::setprecision(6) << '\n';
+    }
+    std::cout << '\n';
+}
+
+int main(int argc, char *argv[]) {
+    const CpuCostConfig config = parse_args(argc, argv);
+    for_each_engine([&]<template <typename> class Q>() {
+        if (config.engine == "all" || config.engine == EngineTraits<Q>::name) {
+            measure_costs<Q>(config);
+        }
+    });
+}
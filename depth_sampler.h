@@ -0,0 +1,85 @@
+#pragma once
+
+// This file contains `DepthSampler`, which records a queue's depth over time
+// to a CSV file, for capacity planning.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// `DepthSampler` runs a background thread that, every `interval`, appends a
+// row to a CSV file with the columns
+//
+//     seconds,size,high_water_mark
+//
+// where `seconds` is the time since the sampler started, and the others are
+// `queue.size_approx()` and `queue.high_water_mark()`. The sampler stops,
+// and the file is flushed and closed, when the sampler is destroyed, which
+// must happen before `queue` is destroyed.
+template <typename SomeQueue>
+class DepthSampler {
+    const SomeQueue& queue;
+    std::ofstream out;
+    std::mutex mutex;
+    std::condition_variable stopped;
+    bool stopping = false;
+    std::thread thread;
+
+public:
+    // Throw `std::runtime_error` if the file at `path` can't be opened.
+    DepthSampler(const SomeQueue& queue, const std::string& path, std::chrono::milliseconds interval);
+    ~DepthSampler();
+
+    DepthSampler(const DepthSampler&) = delete;
+    DepthSampler& operator=(const DepthSampler&) = delete;
+
+private:
+    void run(std::chrono::milliseconds interval);
+};
+
+template <typename SomeQueue>
+DepthSampler<SomeQueue>::DepthSampler(const SomeQueue& queue, const std::string& path,
+                                      std::chrono::milliseconds interval)
+: queue(queue)
+, out(path) {
+    if (!out) {
+        throw std::runtime_error("unable to open " + path);
+    }
+    out << "seconds,size,high_water_mark\n";
+    thread = std::thread([this, interval]() { run(interval); });
+}
+
+template <typename SomeQueue>
+DepthSampler<SomeQueue>::~DepthSampler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stopped.notify_one();
+    thread.join();
+}
+
+template <typename SomeQueue>
+void DepthSampler<SomeQueue>::run(std::chrono::milliseconds interval) {
+    const auto started = std::chrono::steady_clock::now();
+    auto next = started;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        const std::size_t size = queue.size_approx();
+        const std::size_t high_water_mark = queue.high_water_mark();
+        out << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() << ','
+            << size << ',' << high_water_mark << '\n';
+        // Sample on a fixed schedule, rather than at fixed gaps after each
+        // sample, so that the series doesn't drift.
+        next += interval;
+        if (stopped.wait_until(lock, next, [this]() { return stopping; })) {
+            break;
+        }
+    }
+    out.flush();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// This file contains `EventFdNotifier`, a `Notifier` that makes an eventfd
+// readable, so that a consumer can wait for a `Queue` with `poll`, `select`
+// or `epoll` alongside its sockets.
+
+#include "notifier.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// `EventFdNotifier` owns a non-blocking eventfd. `fd()` becomes readable
+// when the notifier fires, and stays readable until `consume()` is called.
+// Since the notifier fires at most once per `arm`, the eventfd's counter is
+// normally one when read.
+//
+// The constructor throws `std::runtime_error` if the eventfd can't be
+// created.
+//
+//     Queue<Request> queue;
+//     EventFdNotifier notifier;
+//     queue.set_notifier(&notifier);
+//     // Register `notifier.fd()` with epoll for `EPOLLIN`. Then, when it's
+//     // readable, call `notifier.consume()` and drain the queue, arming the
+//     // notifier as `Notifier` describes.
+class EventFdNotifier : public Notifier {
+    const int descriptor;
+
+public:
+    EventFdNotifier();
+    ~EventFdNotifier() override;
+
+    int fd() const;
+    // Reset the eventfd so that it's no longer readable, and return how many
+    // times the notifier fired since the last reset.
+    std::uint64_t consume();
+
+protected:
+    void fire() override;
+};
+
+inline EventFdNotifier::EventFdNotifier()
+: descriptor(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (descriptor == -1) {
+        throw std::runtime_error(std::string("eventfd: ") + std::strerror(errno));
+    }
+}
+
+inline EventFdNotifier::~EventFdNotifier() {
+    close(descriptor);
+}
+
+inline int EventFdNotifier::fd() const {
+    return descriptor;
+}
+
+inline std::uint64_t EventFdNotifier::consume() {
+    std::uint64_t count = 0;
+    // This fails with `EAGAIN` if the counter is zero, which is fine.
+    if (read(descriptor, &count, sizeof count) != sizeof count) {
+        return 0;
+    }
+    return count;
+}
+
+inline void EventFdNotifier::fire() {
+    const std::uint64_t one = 1;
+    // This can fail only if the counter would overflow, in which case the
+    // eventfd is readable anyway.
+    (void)!write(descriptor, &one, sizeof one);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+// This file contains thin wrappers around Linux's futex system call, and
+// `EventCount`, which lets threads sleep until a condition (such as "the
+// queue is not empty") might have become true, without the notifying side
+// paying for a system call unless someone is actually asleep.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t),
+    "futex words must be plain 32-bit integers");
+
+// Sleep while `*word == expected`, until woken by `futex_wake`, or until
+// `timeout` has elapsed if it is not negative. Return `false` if the timeout
+// elapsed, and `true` otherwise. Like the system call, this can return
+// spuriously, so callers must recheck their condition.
+inline bool futex_wait(std::atomic<std::uint32_t>& word, std::uint32_t expected,
+                       std::chrono::nanoseconds timeout = std::chrono::nanoseconds(-1)) {
+    timespec relative;
+    timespec *relative_ptr = nullptr;
+    if (timeout.count() >= 0) {
+        relative.tv_sec = timeout.count() / 1'000'000'000;
+        relative.tv_nsec = timeout.count() % 1'000'000'000;
+        relative_ptr = &relative;
+    }
+    const long rc = syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected,
+        relative_ptr, nullptr, 0);
+    return !(rc == -1 && errno == ETIMEDOUT);
+}
+
+// Wake at most `count` threads sleeping in `futex_wait` on `word`.
+inline void futex_wake(std::atomic<std::uint32_t>& word, int count) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+// `EventCount` is a futex-based "eventcount." A thread that wants to wait
+// for some condition does this:
+//
+//     for (;;) {
+//         if (condition()) break;
+//         const EventCount::Key key = events.prepare_wait();
+//         if (condition()) {
+//             events.cancel_wait();
+//             break;
+//         }
+//         events.wait(key);
+//     }
+//
+// and a thread that might have made the condition true calls `notify_one()`
+// or `notify_all()` afterward. Checking the condition again after
+// `prepare_wait()` is what prevents lost wakeups: either the notifier sees
+// the registered waiter, or the waiter sees the notifier's change. This
+// relies on both the condition's change and check being sequentially
+// consistent, as `Queue`'s operations are.
+//
+// Notifying costs only a load when nobody is waiting.
+class EventCount {
+    // Incremented by every notification that finds a waiter. Waiters sleep
+    // on this.
+    std::atomic<std::uint32_t> epoch;
+    // Number of threads between `prepare_wait()` and the end of `wait()` or
+    // `cancel_wait()`.
+    std::atomic<std::uint32_t> waiters;
+
+public:
+    using Key = std::uint32_t;
+
+    EventCount();
+
+    Key prepare_wait();
+    void cancel_wait();
+    // Sleep until notified after the `prepare_wait()` that returned `key`.
+    void wait(Key key);
+    // Like `wait`, but give up after `timeout`. Return whether notified.
+    bool wait_for(Key key, std::chrono::nanoseconds timeout);
+
+    void notify_one();
+    void notify_all();
+    // Return whether any thread is between `prepare_wait()` and the end of
+    // its wait.
+    bool has_waiters() const;
+};
+
+inline EventCount::EventCount()
+: epoch(0)
+, waiters(0) {}
+
+inline EventCount::Key EventCount::prepare_wait() {
+    waiters.fetch_add(1);
+    return epoch.load();
+}
+
+inline void EventCount::cancel_wait() {
+    waiters.fetch_sub(1);
+}
+
+inline void EventCount::wait(Key key) {
+    while (epoch.load() == key) {
+        futex_wait(epoch, key);
+    }
+    waiters.fetch_sub(1);
+}
+
+inline bool EventCount::wait_for(Key key, std::chrono::nanoseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool notified;
+    while (!(notified = epoch.load() != key)) {
+        const auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero()) {
+            break;
+        }
+        futex_wait(epoch, key, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+    }
+    waiters.fetch_sub(1);
+    return notified;
+}
+
+inline void EventCount::notify_one() {
+    if (waiters.load()) {
+        epoch.fetch_add(1);
+        futex_wake(epoch, 1);
+    }
+}
+
+inline void EventCount::notify_all() {
+    if (waiters.load()) {
+        epoch.fetch_add(1);
+        futex_wake(epoch, INT32_MAX);
+    }
+}
+
+inline bool EventCount::has_waiters() const {
+    return waiters.load() != 0;
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+// This file contains `IoUring`, a minimal io_uring instance made with the raw
+// system calls, for use by `MsgRingNotifier`, its tests, and programs that
+// don't otherwise use liburing. It supports getting submission queue entries
+// one at a time, submitting them (optionally waiting for completions), and
+// reaping completions.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// `IoUring` owns an io_uring. Only one thread at a time may use it. The
+// constructor throws `std::runtime_error` if the kernel doesn't support
+// io_uring or won't create one.
+class IoUring {
+    int descriptor;
+    void *sq_mapping;
+    std::size_t sq_mapping_size;
+    void *cq_mapping;
+    std::size_t cq_mapping_size;
+    io_uring_sqe *sqes;
+    std::size_t sqes_size;
+
+    // Submission queue, shared with the kernel.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    // Entries gotten but not yet submitted are between `sq_submitted` and
+    // `sq_local_tail`.
+    unsigned sq_local_tail;
+    unsigned sq_submitted;
+
+    // Completion queue, shared with the kernel.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+public:
+    explicit IoUring(unsigned entries = 64);
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    int fd() const;
+
+    // Return a zeroed submission queue entry to fill in, or null if the
+    // submission queue is full. The entry goes to the kernel with the next
+    // `submit`.
+    io_uring_sqe *get_sqe();
+
+    // Submit the entries gotten since the last call, and wait until there
+    // are at least `wait_for` completions. Return the number of entries
+    // submitted, or `-errno` on failure.
+    int submit(unsigned wait_for = 0);
+
+    // If there's a completion, copy it to `completion`, remove it from the
+    // completion queue, and return `true`. Otherwise, return `false`.
+    bool pop_completion(io_uring_cqe& completion);
+
+    // Return whether the kernel supports the operation `opcode`.
+    bool supports(unsigned opcode) const;
+
+private:
+    template <typename Pointer>
+    static Pointer at(void *mapping, std::uint32_t offset);
+    static void *map(int fd, std::size_t size, off_t offset);
+    // Unmap and close whatever the constructor got to.
+    void release();
+    [[noreturn]] void fail(const char *what);
+};
+
+inline IoUring::IoUring(unsigned entries)
+: sq_mapping(MAP_FAILED)
+, cq_mapping(MAP_FAILED)
+, sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+, sq_local_tail(0)
+, sq_submitted(0) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof params);
+    descriptor = int(syscall(__NR_io_uring_setup, entries, &params));
+    if (descriptor == -1) {
+        throw std::runtime_error(std::string("io_uring_setup: ") + std::strerror(errno));
+    }
+
+    sq_mapping_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_mapping_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // Since Linux 5.4, both rings share one mapping.
+    const bool single_mapping = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mapping) {
+        sq_mapping_size = cq_mapping_size = std::max(sq_mapping_size, cq_mapping_size);
+    }
+    sq_mapping = map(descriptor, sq_mapping_size, IORING_OFF_SQ_RING);
+    if (sq_mapping == MAP_FAILED) {
+        fail("mmap of io_uring submission queue");
+    }
+    cq_mapping = single_mapping ? sq_mapping : map(descriptor, cq_mapping_size, IORING_OFF_CQ_RING);
+    if (cq_mapping == MAP_FAILED) {
+        fail("mmap of io_uring completion queue");
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map(descriptor, sqes_size, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        fail("mmap of io_uring submission queue entries");
+    }
+
+    sq_head = at<unsigned*>(sq_mapping, params.sq_off.head);
+    sq_tail = at<unsigned*>(sq_mapping, params.sq_off.tail);
+    sq_array = at<unsigned*>(sq_mapping, params.sq_off.array);
+    sq_mask = *at<unsigned*>(sq_mapping, params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = sq_submitted = *sq_tail;
+
+    cq_head = at<unsigned*>(cq_mapping, params.cq_off.head);
+    cq_tail = at<unsigned*>(cq_mapping, params.cq_off.tail);
+    cq_mask = *at<unsigned*>(cq_mapping, params.cq_off.ring_mask);
+    cqes = at<io_uring_cqe*>(cq_mapping, params.cq_off.cqes);
+}
+
+inline IoUring::~IoUring() {
+    release();
+}
+
+inline void IoUring::release() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_mapping != MAP_FAILED && cq_mapping != sq_mapping) {
+        munmap(cq_mapping, cq_mapping_size);
+    }
+    if (sq_mapping != MAP_FAILED) {
+        munmap(sq_mapping, sq_mapping_size);
+    }
+    close(descriptor);
+}
+
+inline int IoUring::fd() const {
+    return descriptor;
+}
+
+inline io_uring_sqe *IoUring::get_sqe() {
+    const unsigned head = std::atomic_ref<unsigned>(*sq_head).load(std::memory_order_acquire);
+    if (sq_local_tail - head >= sq_entries) {
+        return nullptr;
+    }
+    const unsigned index = sq_local_tail & sq_mask;
+    ++sq_local_tail;
+    sq_array[index] = index;
+    io_uring_sqe *const sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+inline int IoUring::submit(unsigned wait_for) {
+    std::atomic_ref<unsigned>(*sq_tail).store(sq_local_tail, std::memory_order_release);
+    const unsigned to_submit = sq_local_tail - sq_submitted;
+    sq_submitted = sq_local_tail;
+    long rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, descriptor, to_submit, wait_for,
+            wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    } while (rc == -1 && errno == EINTR && wait_for);
+    return rc == -1 ? -errno : int(rc);
+}
+
+inline bool IoUring::pop_completion(io_uring_cqe& completion) {
+    const unsigned head = *cq_head;
+    if (head == std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire)) {
+        return false;
+    }
+    completion = cqes[head & cq_mask];
+    std::atomic_ref<unsigned>(*cq_head).store(head + 1, std::memory_order_release);
+    return true;
+}
+
+inline bool IoUring::supports(unsigned opcode) const {
+    const unsigned n_ops = 256;
+    // `io_uring_probe` ends in a flexible array of `io_uring_probe_op`.
+    std::vector<std::uint64_t> buffer(
+        (sizeof(io_uring_probe) + n_ops * sizeof(io_uring_probe_op)) / sizeof(std::uint64_t) + 1);
+    io_uring_probe *const probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (syscall(__NR_io_uring_register, descriptor, IORING_REGISTER_PROBE, probe, n_ops) == -1) {
+        return false;
+    }
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+template <typename Pointer>
+Pointer IoUring::at(void *mapping, std::uint32_t offset) {
+    return reinterpret_cast<Pointer>(static_cast<char*>(mapping) + offset);
+}
+
+inline void *IoUring::map(int fd, std::size_t size, off_t offset) {
+    return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+inline void IoUring::fail(const char *what) {
+    const std::string message = std::string(what) + ": " + std::strerror(errno);
+    release();
+    throw std::runtime_error(message);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+// This file contains low-overhead timing (`read_tsc`) and a histogram of
+// durations with bounded relative error (`LatencyHistogram`), in the style
+// of HdrHistogram.
+
+#include "per_thread.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Return the current value of the CPU's time stamp counter, or, on
+// architectures without one, a nanosecond count from `steady_clock`.
+// Convert differences of these values to nanoseconds using `tsc_per_ns()`.
+inline std::uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Return the number of `read_tsc()` ticks per nanosecond. The first call
+// calibrates the counter against `steady_clock`, which takes about ten
+// milliseconds.
+inline double tsc_per_ns() {
+    static const double ratio = []() {
+        const auto wall_before = std::chrono::steady_clock::now();
+        const std::uint64_t tsc_before = read_tsc();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        const auto wall_after = std::chrono::steady_clock::now();
+        const std::uint64_t tsc_after = read_tsc();
+        const double ns = std::chrono::duration<double, std::nano>(wall_after - wall_before).count();
+        return ns > 0 ? (tsc_after - tsc_before) / ns : 1.0;
+    }();
+    return ratio;
+}
+
+// `LatencyHistogram` counts values (e.g. durations in ticks) in buckets
+// whose width is proportional to their magnitude, so that every recorded
+// value is known to within about 1.6% (`1 / 2^(sub_bucket_bits - 1)`),
+// while the whole 64-bit range fits in a few thousand counters.
+//
+// Values below `2^sub_bucket_bits` each get their own bucket. Above that,
+// each power of two is divided into `2^(sub_bucket_bits - 1)` buckets.
+//
+// Only one thread may `record` into a histogram at a time, but other
+// threads may read it (e.g. `merge` it into another histogram) concurrently.
+class LatencyHistogram {
+public:
+    static constexpr int sub_bucket_bits = 7;
+    static constexpr int half = 1 << (sub_bucket_bits - 1);
+    static constexpr int n_buckets = (64 - sub_bucket_bits + 2) * half;
+
+private:
+    std::atomic<std::uint64_t> counts[n_buckets] = {};
+    std::atomic<std::uint64_t> total = 0;
+    std::atomic<std::uint64_t> maximum = 0;
+
+public:
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator=(const LatencyHistogram&);
+
+    void record(std::uint64_t value);
+    // Add the counts from `other` into this histogram.
+    void merge(const LatencyHistogram& other);
+
+    std::uint64_t count() const;
+    std::uint64_t max() const;
+    // Return the smallest value such that `quantile` of recorded values are
+    // less than or equal to it, e.g. `value_at(0.99)` is the 99th
+    // percentile. Return zero if the histogram is empty.
+    std::uint64_t value_at(double quantile) const;
+
+    static int bucket_of(std::uint64_t value);
+    // Return the largest value that falls into the bucket at `index`.
+    static std::uint64_t highest_in(int index);
+};
+
+inline LatencyHistogram::LatencyHistogram(const LatencyHistogram& other) {
+    merge(other);
+}
+
+inline LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other) {
+    if (this != &other) {
+        for (std::atomic<std::uint64_t>& counter : counts) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        maximum.store(0, std::memory_order_relaxed);
+        merge(other);
+    }
+    return *this;
+}
+
+inline void LatencyHistogram::record(std::uint64_t value) {
+    bump(counts[bucket_of(value)]);
+    bump(total);
+    if (value > maximum.load(std::memory_order_relaxed)) {
+        maximum.store(value, std::memory_order_relaxed);
+    }
+}
+
+inline void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < n_buckets; ++i) {
+        if (const std::uint64_t count = other.counts[i].load(std::memory_order_relaxed)) {
+            bump(counts[i], count);
+        }
+    }
+    bump(total, other.total.load(std::memory_order_relaxed));
+    const std::uint64_t other_max = other.maximum.load(std::memory_order_relaxed);
+    if (other_max > maximum.load(std::memory_order_relaxed)) {
+        maximum.store(other_max, std::memory_order_relaxed);
+    }
+}
+
+inline std::uint64_t LatencyHistogram::count() const {
+    return total.load(std::memory_order_relaxed);
+}
+
+inline std::uint64_t LatencyHistogram::max() const {
+    return maximum.load(std::memory_order_relaxed);
+}
+
+inline std::uint64_t LatencyHistogram::value_at(double quantile) const {
+    // Sum the buckets rather than trusting `total`, since a concurrent
+    // `record` might have updated one but not yet the other.
+    std::uint64_t n = 0;
+    for (const std::atomic<std::uint64_t>& counter : counts) {
+        n += counter.load(std::memory_order_relaxed);
+    }
+    if (n == 0) {
+        return 0;
+    }
+    std::uint64_t rank = std::uint64_t(std::ceil(quantile * n));
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > n) {
+        rank = n;
+    }
+    std::uint64_t seen = 0;
+    for (int i = 0; i < n_buckets; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            const std::uint64_t highest = highest_in(i);
+            return highest < max() ? highest : max();
+        }
+    }
+    return max();
+}
+
+inline int LatencyHistogram::bucket_of(std::uint64_t value) {
+    const int magnitude = std::bit_width(value);
+    if (magnitude <= sub_bucket_bits) {
+        return int(value);
+    }
+    const int shift = magnitude - sub_bucket_bits;
+    // `value >> shift` is in `[half, 2 * half)`.
+    return shift * half + int(value >> shift);
+}
+
+inline std::uint64_t LatencyHistogram::highest_in(int index) {
+    if (index < 2 * half) {
+        return std::uint64_t(index);
+    }
+    const int shift = index / half - 1;
+    const std::uint64_t sub_bucket = index - shift * half;
+    return ((sub_bucket + 1) << shift) - 1;
+}
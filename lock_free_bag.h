@@ -0,0 +1,280 @@
+#pragma once
+
+#include "per_thread.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// `LockFreeBag<T>` is an unordered collection of `T` that any thread can
+// `add` to or `try_remove` from.
+//
+// Use it instead of `Queue` when the order in which elements come out
+// doesn't matter, e.g. for pools of reusable objects, or for tasks that any
+// worker can run.
+//
+// Each thread has its own "local" list of elements, which is a work-stealing
+// deque (Chase & Lev, "Dynamic Circular Work-Stealing Deque," 2005).
+// `add` pushes onto the bottom of the calling thread's list, and
+// `try_remove` pops from the bottom of the calling thread's list. Only the
+// owning thread ever writes the bottom of a list, so adds and removes that
+// stay thread-local perform no read-modify-write operations, with one
+// exception: taking the very last element of a list races with thieves, and
+// so requires a compare-and-swap.
+//
+// When the calling thread's list is empty, `try_remove` "steals" from the top
+// of other threads' lists, using a compare-and-swap.
+//
+// Nodes (the storage for elements) are recycled through a per-thread cache,
+// which, like `Queue`'s free list, never shrinks. A node always goes back to
+// the thread that added it: a thief pushes the node it stole onto its
+// victim's "returned" stack, which the victim drains into its cache when the
+// cache runs dry. So a thread that only adds reuses the nodes that other
+// threads took from it, and a thread that only removes holds on to none.
+template <typename T>
+class LockFreeBag {
+    struct Node {
+        union {
+            T value;
+        };
+        // `next` is used only while the node is in a thread's cache or
+        // returned stack.
+        Node *next;
+
+        Node()
+        : next(nullptr) {}
+
+        ~Node() {}
+    };
+
+    // `Array` is the circular buffer underlying a thread's deque.
+    struct Array {
+        const std::int64_t capacity; // a power of two
+        const std::unique_ptr<std::atomic<Node*>[]> slots;
+        // Arrays that have been outgrown are kept (in a list) until the bag is
+        // destroyed, because thieves might still be reading from them.
+        Array *const previous;
+
+        Array(std::int64_t capacity, Array *previous)
+        : capacity(capacity)
+        , slots(new std::atomic<Node*>[capacity])
+        , previous(previous) {}
+
+        std::atomic<Node*>& slot(std::int64_t index) {
+            return slots[index & (capacity - 1)];
+        }
+    };
+
+    struct Local {
+        // Thieves compare-and-swap `top`, while the owner writes `bottom`, so
+        // keep them on separate cache lines.
+        alignas(64) std::atomic<std::int64_t> top;
+        alignas(64) std::atomic<std::int64_t> bottom;
+        std::atomic<Array*> array;
+        // `cache` is touched only by the owning thread.
+        Node *cache;
+        // Thieves push the nodes they've finished with onto `returned`, and
+        // the owner takes the whole stack at once. Since nodes are never
+        // popped one at a time, the stack is not subject to ABA.
+        std::atomic<Node*> returned;
+        // the number of nodes the owner has allocated
+        std::atomic<std::uint64_t> allocations;
+
+        Local();
+        ~Local();
+
+        Array *grow(std::int64_t bottom, std::int64_t top);
+    };
+
+    PerThread<Local> locals;
+
+public:
+    template <typename Value>
+    void add(Value&& value);
+
+    // Remove and return an element, preferring one that the calling thread
+    // added. Return `std::nullopt` if no element could be found. Since other
+    // threads can add and remove concurrently, an empty result does not mean
+    // that the bag was empty at any particular instant.
+    std::optional<T> try_remove();
+
+    // Return the number of nodes that the bag has allocated so far. Nodes are
+    // not freed until the bag is destroyed.
+    std::uint64_t allocations() const;
+
+private:
+    static std::optional<T> try_take(Local&);
+    static std::optional<T> try_steal(Local& victim);
+    static std::optional<T> consume(Node *node);
+};
+
+template <typename T>
+LockFreeBag<T>::Local::Local()
+: top(0)
+, bottom(0)
+, array(new Array(64, nullptr))
+, cache(nullptr)
+, returned(nullptr)
+, allocations(0) {}
+
+template <typename T>
+LockFreeBag<T>::Local::~Local() {
+    // The bag is being destroyed, so there are no concurrent users.
+    Array *current = array.load(std::memory_order_relaxed);
+    const std::int64_t end = bottom.load(std::memory_order_relaxed);
+    for (std::int64_t i = top.load(std::memory_order_relaxed); i < end; ++i) {
+        Node *node = current->slot(i).load(std::memory_order_relaxed);
+        node->value.~T();
+        delete node;
+    }
+
+    Array *previous;
+    for (; current; current = previous) {
+        previous = current->previous;
+        delete current;
+    }
+
+    Node *next;
+    for (Node *node = cache; node; node = next) {
+        next = node->next;
+        delete node;
+    }
+    for (Node *node = returned.load(std::memory_order_acquire); node; node = next) {
+        next = node->next;
+        delete node;
+    }
+}
+
+template <typename T>
+typename LockFreeBag<T>::Array *LockFreeBag<T>::Local::grow(std::int64_t bottom, std::int64_t top) {
+    Array *old_array = array.load(std::memory_order_relaxed);
+    Array *new_array = new Array(old_array->capacity * 2, old_array);
+    for (std::int64_t i = top; i < bottom; ++i) {
+        new_array->slot(i).store(old_array->slot(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    array.store(new_array, std::memory_order_release);
+    return new_array;
+}
+
+template <typename T>
+template <typename Value>
+void LockFreeBag<T>::add(Value&& value) {
+    Local& local = locals.local();
+
+    Node *node = local.cache;
+    if (!node) {
+        node = local.returned.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (node) {
+        local.cache = node->next;
+    } else {
+        node = new Node;
+        bump(local.allocations);
+    }
+    new (&node->value) T(std::forward<Value>(value));
+
+    const std::int64_t b = local.bottom.load(std::memory_order_relaxed);
+    const std::int64_t t = local.top.load(std::memory_order_acquire);
+    Array *array = local.array.load(std::memory_order_relaxed);
+    if (b - t >= array->capacity) {
+        array = local.grow(b, t);
+    }
+    array->slot(b).store(node, std::memory_order_relaxed);
+    // Every store to `bottom` is at least a release, so that a thief that
+    // reads any value of `bottom` also sees the slots (and nodes) below it.
+    local.bottom.store(b + 1, std::memory_order_release);
+}
+
+template <typename T>
+std::optional<T> LockFreeBag<T>::try_remove() {
+    Local& local = locals.local();
+    if (std::optional<T> result = try_take(local)) {
+        return result;
+    }
+
+    std::optional<T> result;
+    locals.for_each([&](Local& victim) {
+        if (&victim != &local) {
+            result = try_steal(victim);
+        }
+        return result.has_value();
+    });
+    return result;
+}
+
+template <typename T>
+std::optional<T> LockFreeBag<T>::try_take(Local& local) {
+    const std::int64_t b = local.bottom.load(std::memory_order_relaxed) - 1;
+    Array *array = local.array.load(std::memory_order_relaxed);
+    // The store to `bottom` and the load of `top` must not be reordered with
+    // each other, so both are sequentially consistent. This is the "fence" in
+    // the original algorithm.
+    local.bottom.store(b);
+    std::int64_t t = local.top.load();
+
+    if (t > b) {
+        // The deque was empty. Restore it.
+        local.bottom.store(b + 1, std::memory_order_release);
+        return std::nullopt;
+    }
+
+    Node *node = array->slot(b).load(std::memory_order_relaxed);
+    if (t == b) {
+        // This is the last element, so thieves might be after it too.
+        const bool won = local.top.compare_exchange_strong(t, t + 1);
+        local.bottom.store(b + 1, std::memory_order_release);
+        if (!won) {
+            return std::nullopt;
+        }
+    }
+
+    std::optional<T> result = consume(node);
+    node->next = local.cache;
+    local.cache = node;
+    return result;
+}
+
+template <typename T>
+std::optional<T> LockFreeBag<T>::try_steal(Local& victim) {
+    std::int64_t t = victim.top.load();
+    const std::int64_t b = victim.bottom.load();
+    if (t >= b) {
+        return std::nullopt;
+    }
+
+    Array *array = victim.array.load(std::memory_order_acquire);
+    Node *node = array->slot(t).load(std::memory_order_relaxed);
+    if (!victim.top.compare_exchange_strong(t, t + 1)) {
+        // Another thief, or the owner, got there first. Rather than retry,
+        // let the caller move on to the next victim.
+        return std::nullopt;
+    }
+
+    // Give the node back to the victim, who added it. The release makes the
+    // destruction of the node's value visible to the victim before it reuses
+    // the node.
+    std::optional<T> result = consume(node);
+    Node *head = victim.returned.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!victim.returned.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+    return result;
+}
+
+template <typename T>
+std::optional<T> LockFreeBag<T>::consume(Node *node) {
+    std::optional<T> result(std::move(node->value));
+    node->value.~T();
+    return result;
+}
+
+template <typename T>
+std::uint64_t LockFreeBag<T>::allocations() const {
+    std::uint64_t total = 0;
+    locals.for_each([&](const Local& local) {
+        total += local.allocations.load(std::memory_order_relaxed);
+    });
+    return total;
+}
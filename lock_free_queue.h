@@ -1,6 +1,17 @@
+#pragma once
+
+#include "async_pop.h"
+#include "futex.h"
+#include "notifier.h"
+#include "occupancy.h"
+#include "queue_instrumentation.h"
 
 #include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
 #include <optional>
 
 // `TaggedPtr<T>` is a `T*`, but the least significant bit is used as a tag.
@@ -87,8 +98,24 @@ bool AtomicTaggedPtr<T>::compare_exchange_weak(TaggedPtr<T>& expected, TaggedPtr
     return raw.compare_exchange_weak(expected.raw, desired.raw);
 }
 
+// `Queue<T>` is unbounded by default: `push_back` always succeeds, and
+// allocates a node if none is free. A `Queue` constructed with a capacity
+// instead admits at most that many elements at a time. Then `try_push_back`
+// fails when the queue is full, `push_back` sleeps until there's room, and
+// `try_push_back_for` and `try_push_back_until` sleep for at most a while.
+//
+// A bounded queue counts the pushes it has admitted and the pops it has
+// completed in two counters on separate cache lines. Producers increment the
+// first and consumers the second, so that neither side writes the other's
+// cache line. A producer compares against a copy of the pop count that it
+// refreshes only when the queue looks full, so while the queue isn't full,
+// admission costs producers one compare-and-swap on a line that only other
+// producers write, and consumers one increment and one load.
 template <typename T>
 class Queue {
+public:
+    static constexpr std::size_t unbounded = std::numeric_limits<std::size_t>::max();
+
 private:
     struct Node {
         union {
@@ -105,13 +132,43 @@ private:
     std::atomic<Node*> before_first;
     std::atomic<Node*> last;
     std::atomic<Node*> free_list;
+    OccupancyCounter occupancy;
+    std::atomic<Notifier*> notifier;
+    PopWaiters<T> pop_waiters;
+
+    // The rest is used only if the queue is bounded.
+    const std::size_t limit;
+    // Pushes admitted, and a recent value of `n_popped`, which only grows.
+    alignas(64) std::atomic<std::uint64_t> n_admitted;
+    std::atomic<std::uint64_t> n_popped_seen;
+    // Pops completed, and producers waiting for one.
+    alignas(64) std::atomic<std::uint64_t> n_popped;
+    EventCount not_full;
+
+    [[no_unique_address]] LatencyRecorder<queue_latency_enabled> latency_recorder;
+    [[no_unique_address]] ContentionCounters<queue_stats_enabled> contention;
+    [[no_unique_address]] FairnessRecorder<queue_fairness_enabled> fairness_recorder;
+    [[no_unique_address]] UsdtProbes<queue_usdt_enabled> probes;
 
 public:
     Queue()
+    : Queue(unbounded) {}
+
+    // Create a queue that holds at most `capacity` elements, which must be
+    // positive.
+    explicit Queue(std::size_t capacity)
     : before_first(new Node) // "dummy" node
     , last(before_first.load())
     , free_list(nullptr)
-    {}
+    , notifier(nullptr)
+    , limit(capacity)
+    , n_admitted(0)
+    , n_popped_seen(0)
+    , n_popped(0)
+    {
+        assert(capacity > 0);
+        contention.allocated();
+    }
 
     ~Queue() {
         Node *next;
@@ -136,14 +193,211 @@ public:
         }
     }
 
+    // Push `value`. If the queue is bounded, first wait until it isn't full.
     template <typename Value>
     void push_back(Value&& value) {
+        if (bounded()) {
+            (void)wait_for_slot(std::nullopt);
+        }
+        enqueue(std::forward<Value>(value));
+    }
+
+    // Push `value` and return `true` unless the queue is full, in which case
+    // return `false` and leave `value` alone.
+    template <typename Value>
+    bool try_push_back(Value&& value) {
+        if (bounded() && !try_admit()) {
+            return false;
+        }
+        enqueue(std::forward<Value>(value));
+        return true;
+    }
+
+    // Like `try_push_back`, but if the queue is full, wait up to `timeout`
+    // for it not to be.
+    template <typename Value, typename Rep, typename Period>
+    bool try_push_back_for(Value&& value, const std::chrono::duration<Rep, Period>& timeout) {
+        return try_push_back_until(std::forward<Value>(value), std::chrono::steady_clock::now() + timeout);
+    }
+
+    // Like `try_push_back`, but if the queue is full, wait until `deadline`
+    // for it not to be.
+    template <typename Value, typename Clock, typename Duration>
+    bool try_push_back_until(Value&& value, const std::chrono::time_point<Clock, Duration>& deadline) {
+        if (bounded()) {
+            // Measure the wait on `steady_clock`, whatever `Clock` is.
+            const auto remaining = std::chrono::duration_cast<std::chrono::steady_clock::duration>(deadline - Clock::now());
+            if (!wait_for_slot(std::chrono::steady_clock::now() + remaining)) {
+                return false;
+            }
+        }
+        enqueue(std::forward<Value>(value));
+        return true;
+    }
+
+    std::optional<T> try_pop_front() {
+        std::optional<T> result = dequeue();
+        if (bounded() && result) {
+            n_popped.fetch_add(1);
+            not_full.notify_one();
+        }
+        return result;
+    }
+
+    // Return an awaitable whose `co_await` yields the front element,
+    // suspending the awaiting coroutine until there is one. The push that
+    // provides the element resumes the coroutine on the pushing thread,
+    // before the push returns. The queue must outlive any suspended
+    // coroutine.
+    PopAwaiter<Queue, T> pop() {
+        return PopAwaiter<Queue, T>(*this, pop_waiters);
+    }
+
+    // Like `pop()`, but have the push that provides the element resume the
+    // coroutine by calling `executor.schedule(std::coroutine_handle<>)`.
+    template <typename Executor>
+    PopAwaiter<Queue, T> pop(Executor& executor) {
+        return PopAwaiter<Queue, T>(*this, pop_waiters, executor);
+    }
+
+    // Have every push call `new_notifier->notify()`, or stop notifying if
+    // `new_notifier` is null. The notifier must outlive its use here.
+    void set_notifier(Notifier *new_notifier) {
+        notifier.store(new_notifier);
+    }
+
+    // Return the most elements the queue can hold, or `unbounded`.
+    std::size_t capacity() const {
+        return limit;
+    }
+
+    // Return approximately how many elements are in the queue. The count
+    // is exact if no other thread is pushing or popping, and otherwise might
+    // be off by the number of operations in progress. This costs time
+    // proportional to the number of threads that have used the queue, but
+    // no writes to memory shared with `push_back` or `try_pop_front`.
+    std::size_t size_approx() const {
+        return std::size_t(occupancy.size());
+    }
+
+    // Return whether the queue has no elements. Unlike `size_approx()`, this
+    // is exact: it's linearizable, with the answer true at the moment the
+    // dummy node's link was read, though another thread can change it
+    // immediately afterward. It takes constant time unless pops keep moving
+    // the front of the queue while it reads.
+    bool empty() const {
+        for (;;) {
+            Node *const dummy = before_first.load();
+            Node *const first = dummy->next.load().ptr();
+            // If `dummy` was popped meanwhile, its link might be anything,
+            // e.g. a free list link, so read again.
+            if (before_first.load() == dummy) {
+                return !first;
+            }
+        }
+    }
+
+    // Return the largest `size_approx()` observed so far. Besides every call
+    // to `size_approx()`, each pushing thread observes the size every
+    // `OccupancyCounter::high_water_period` of its pushes.
+    std::size_t high_water_mark() const {
+        return std::size_t(occupancy.high_water_mark());
+    }
+
+    // Return the latencies recorded so far, summed over all threads. Unless
+    // `LOCK_FREE_QUEUE_LATENCY` is defined, nothing is recorded and the
+    // histograms are empty.
+    QueueLatency latency() const {
+        return latency_recorder.snapshot();
+    }
+
+    // Return what each thread has done to the queue so far. Unless
+    // `LOCK_FREE_QUEUE_FAIRNESS` is defined, nothing is recorded and there
+    // are no threads.
+    QueueFairness fairness() const {
+        return fairness_recorder.snapshot();
+    }
+
+    // Return the compare-and-swap and node counters recorded so far, summed
+    // over all threads. Unless `LOCK_FREE_QUEUE_STATS` is defined, nothing is
+    // counted and all of the counters are zero.
+    QueueStats stats() const {
+        return contention.snapshot();
+    }
+
+private:
+    bool bounded() const {
+        return limit != unbounded;
+    }
+
+    // Admit one push if the queue isn't full, and return whether it did.
+    bool try_admit() {
+        std::uint64_t admitted = n_admitted.load();
+        for (;;) {
+            // The difference can be negative if `admitted` is stale, in which
+            // case the compare-and-swap will fail.
+            if (std::int64_t(admitted - n_popped_seen.load()) >= std::int64_t(limit)) {
+                const std::uint64_t popped = n_popped.load();
+                n_popped_seen.store(popped);
+                if (std::int64_t(admitted - popped) >= std::int64_t(limit)) {
+                    return false;
+                }
+            }
+            if (n_admitted.compare_exchange_weak(admitted, admitted + 1)) {
+                return true;
+            }
+        }
+    }
+
+    // Admit one push, sleeping while the queue is full, but not past
+    // `deadline` if there is one. Return whether the push was admitted.
+    bool wait_for_slot(std::optional<std::chrono::steady_clock::time_point> deadline) {
+        for (;;) {
+            if (try_admit()) {
+                return true;
+            }
+            const EventCount::Key key = not_full.prepare_wait();
+            if (try_admit()) {
+                not_full.cancel_wait();
+                return true;
+            }
+            if (!deadline) {
+                not_full.wait(key);
+                continue;
+            }
+            const auto remaining = *deadline - std::chrono::steady_clock::now();
+            if (remaining <= remaining.zero()) {
+                not_full.cancel_wait();
+                return false;
+            }
+            not_full.wait_for(key, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+        }
+    }
+
+    // Count a compare-and-swap at `site`, and return whether it `succeeded`.
+    bool counted(CasSite site, bool succeeded) {
+        contention.attempt(site, succeeded);
+        if (!succeeded) {
+            fairness_recorder.retry();
+            probes.cas_retry(this, site);
+        }
+        return succeeded;
+    }
+
+    // Push `value` without regard to capacity.
+    template <typename Value>
+    void enqueue(Value&& value) {
+        const auto timer = latency_recorder.start();
+        const auto attempt = fairness_recorder.begin();
+
         // Get a node from the free list, or otherwise allocate a new node.
         Node *node;
         TaggedPtr<Node> next;
         do {
             node = free_list.load();
             if (!node) {
+                contention.miss(FreeListMiss::empty);
+                probes.free_list_miss(this, FreeListMiss::empty);
                 break;
             }
             next = node->next.load();
@@ -151,14 +405,22 @@ public:
             // A node is busy if its value is being moved from or is being destroyed.
             if (next.bit()) {
                 // The node is busy. Bail.
+                contention.bail(CasSite::free_list_pop);
+                contention.miss(FreeListMiss::busy);
+                probes.free_list_miss(this, FreeListMiss::busy);
                 node = nullptr;
                 break;
             }
             // The node is not busy. Snatch it.
-        } while (!free_list.compare_exchange_weak(node, next.ptr()));
+        } while (!counted(CasSite::free_list_pop, free_list.compare_exchange_weak(node, next.ptr())));
         
-        if (!node) {
+        if (node) {
+            contention.hit();
+            probes.free_list_hit(this, node);
+        } else {
             node = new Node;
+            contention.allocated();
+            probes.node_alloc(this, node);
         }
 
         new (&node->value) T(std::forward<Value>(value));
@@ -167,9 +429,24 @@ public:
         node->next.store(TaggedPtr<Node>(nullptr, true), std::memory_order_relaxed);
 
         push_back_node(node); // the real guts of the implementation
+        occupancy.pushed();
+        if (Notifier *const consumer = notifier.load()) {
+            consumer->notify();
+        }
+
+        probes.push_back(this, node);
+        fairness_recorder.end_push_back(attempt);
+        latency_recorder.stop_push_back(timer);
+
+        // Waiting coroutines take elements through `try_pop_front`, so that
+        // they see them in the same order as everyone else.
+        pop_waiters.wake([this]() { return try_pop_front(); });
     }
 
-    std::optional<T> try_pop_front() {
+    // Pop the front element, if any, without regard to capacity.
+    std::optional<T> dequeue() {
+        const auto timer = latency_recorder.start();
+        const auto attempt = fairness_recorder.begin();
         std::optional<T> result;
 
         // `before_first` always refers to a "dummy" node that either never had
@@ -185,18 +462,22 @@ public:
             old_before_first = before_first.load();
             new_before_first = old_before_first->next.load().ptr();
             if (!new_before_first) {
+                probes.try_pop_front(this, false);
+                fairness_recorder.end_try_pop_front(attempt, false);
+                latency_recorder.stop_try_pop_front(timer, false);
                 return result; // empty queue
             }
-        } while (!before_first.compare_exchange_weak(old_before_first, new_before_first));
+        } while (!counted(CasSite::before_first, before_first.compare_exchange_weak(old_before_first, new_before_first)));
+        occupancy.popped();
 
         // Move the return value out of `new_before_first` and destroy the
         // empty source.
         // Unset the "busy" bit once we've done this.
-        const auto set_busy_bit = [](Node *node, bool bit) {
+        const auto set_busy_bit = [this](Node *node, bool bit) {
             TaggedPtr<Node> next;
             do {
                 next = node->next.load();
-            } while (!node->next.compare_exchange_weak(next, TaggedPtr<Node>(next.ptr(), bit)));
+            } while (!counted(CasSite::set_busy_bit, node->next.compare_exchange_weak(next, TaggedPtr<Node>(next.ptr(), bit))));
         };
         result = std::move(new_before_first->value);
         new_before_first->value.~T();
@@ -214,13 +495,16 @@ public:
             TaggedPtr<Node> old_next;
             do {
                 old_next = old_before_first->next.load();
-            } while (!old_before_first->next.compare_exchange_weak(old_next, TaggedPtr<Node>(old_free_list, old_next.bit())));
-        } while (!free_list.compare_exchange_weak(old_free_list, old_before_first));
+            } while (!counted(CasSite::free_list_relink, old_before_first->next.compare_exchange_weak(old_next, TaggedPtr<Node>(old_free_list, old_next.bit()))));
+        } while (!counted(CasSite::free_list_push, free_list.compare_exchange_weak(old_free_list, old_before_first)));
+        contention.returned();
 
+        probes.try_pop_front(this, true);
+        fairness_recorder.end_try_pop_front(attempt, true);
+        latency_recorder.stop_try_pop_front(timer, true);
         return result;
     }
 
-private:
     void push_back_node(Node *node) {
         Node *old_last;
         TaggedPtr<Node> null;
@@ -228,7 +512,7 @@ private:
             old_last = last.load();
             const TaggedPtr<Node> next = old_last->next.load();
             null = TaggedPtr<Node>(nullptr, next.bit());
-        } while (!old_last->next.compare_exchange_weak(null, TaggedPtr<Node>(node, true)));
+        } while (!counted(CasSite::tail_link, old_last->next.compare_exchange_weak(null, TaggedPtr<Node>(node, true))));
 
         // `last` now has `node` as its successor, and since `last->next`
         // is no longer `nullptr`, other calls to `push_back_node` are spinning
@@ -0,0 +1,240 @@
+#pragma once
+
+// This file contains `MsgRingNotifier`, a `Notifier` that wakes a consumer
+// running an io_uring event loop by posting a completion directly to the
+// consumer's ring with `IORING_OP_MSG_RING` (Linux 5.18). Compared with
+// having the ring read an eventfd, this saves the consumer a system call and
+// a completion per wakeup, and lets a producer that has its own ring send
+// the wakeup along with its other submissions, rather than in a system call
+// of its own.
+//
+// If the kernel doesn't support `IORING_OP_MSG_RING`, the notifier falls back
+// to an eventfd, which the consumer's ring polls. The consumer sees the
+// same completion either way. The eventfd is also how a message that fails,
+// e.g. with `EOVERFLOW` because the consumer's completion queue is full, is
+// resent, so that a failure never loses a wakeup.
+
+#include "io_uring.h"
+#include "notifier.h"
+#include "per_thread.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// `MsgRingNotifier` wakes the consumer by delivering a completion whose
+// `user_data` is the value given to the constructor. The consumer does this,
+// where `ring` is its `IoUring`:
+//
+//     for (;;) {
+//         drain the queue
+//         if (notifier.arm(queue)) {
+//             notifier.watch(ring);
+//             ring.submit(1);
+//             for each completion: if its `user_data` is the notifier's,
+//                 call `notifier.consume()`, else handle it as usual
+//         }
+//     }
+//
+// A producer with a ring of its own can `attach` it. Then a push that fires
+// the notifier only adds an entry to the producer's submission queue, and
+// the wakeup is sent the next time the producer calls `submit`, so a
+// producer must submit promptly after pushing. If the message fails, the
+// producer's ring gets a completion whose `user_data` is
+// `sender_user_data()`, which differs from the consumer's `user_data`. The
+// producer must pass each of its completions to `handle_completion`, which
+// resends failed wakeups through the eventfd:
+//
+//     for each completion:
+//         if (!notifier.handle_completion(completion)) {
+//             handle it as usual
+//         }
+//
+// Any other producer sends the wakeup immediately, through a ring that the
+// notifier owns, and waits for the message's result.
+//
+// The constructor throws `std::runtime_error` if it can't create an eventfd.
+class MsgRingNotifier : public Notifier {
+    const int consumer_ring;
+    const std::uint64_t user_data;
+
+    struct Record {
+        IoUring *ring = nullptr;
+    };
+    PerThread<Record> producers;
+
+    // For producers without a ring of their own. Null if `IORING_OP_MSG_RING`
+    // is unsupported.
+    std::unique_ptr<IoUring> own_ring;
+    std::mutex own_ring_mutex;
+
+    // For the fallback, and for resending failed messages. Only the consumer
+    // uses `watching`, which is whether the consumer's ring is polling
+    // `eventfd_descriptor`.
+    int eventfd_descriptor;
+    bool watching;
+
+public:
+    // Pass `prefer_msg_ring = false` to use the eventfd fallback regardless,
+    // e.g. to compare the two.
+    MsgRingNotifier(const IoUring& consumer, std::uint64_t user_data, bool prefer_msg_ring = true);
+    ~MsgRingNotifier() override;
+
+    // Return whether wakeups are sent with `IORING_OP_MSG_RING`, rather than
+    // through an eventfd.
+    bool uses_msg_ring() const;
+
+    // Have pushes from the calling thread send wakeups through `ring`, which
+    // must outlive the notifier or be detached with `attach(nullptr)`.
+    void attach(IoUring *ring);
+
+    // Called by the consumer after arming. Make sure that `consumer` is
+    // polling the eventfd.
+    void watch(IoUring& consumer);
+
+    // Called by the consumer on receiving the notifier's completion.
+    void consume();
+
+    // Return the `user_data` of the completions that an attached producer
+    // ring gets for failed messages.
+    std::uint64_t sender_user_data() const;
+
+    // Called by a producer with an attached ring for each of its
+    // completions. If `completion` is a failed message, resend the wakeup
+    // through the eventfd. Return whether `completion` was the notifier's.
+    bool handle_completion(const io_uring_cqe& completion);
+
+protected:
+    void fire() override;
+
+private:
+    void prepare_message(io_uring_sqe& sqe) const;
+    void signal_eventfd();
+};
+
+inline MsgRingNotifier::MsgRingNotifier(const IoUring& consumer, std::uint64_t user_data, bool prefer_msg_ring)
+: consumer_ring(consumer.fd())
+, user_data(user_data)
+, eventfd_descriptor(-1)
+, watching(false) {
+    eventfd_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventfd_descriptor == -1) {
+        throw std::runtime_error(std::string("eventfd: ") + std::strerror(errno));
+    }
+    if (prefer_msg_ring && consumer.supports(IORING_OP_MSG_RING)) {
+        try {
+            own_ring = std::make_unique<IoUring>(8);
+        } catch (const std::runtime_error&) {
+            // Use only the eventfd.
+        }
+    }
+}
+
+inline MsgRingNotifier::~MsgRingNotifier() {
+    close(eventfd_descriptor);
+}
+
+inline bool MsgRingNotifier::uses_msg_ring() const {
+    return own_ring != nullptr;
+}
+
+inline void MsgRingNotifier::attach(IoUring *ring) {
+    producers.local().ring = ring;
+}
+
+inline void MsgRingNotifier::watch(IoUring& consumer) {
+    if (watching) {
+        return;
+    }
+    if (io_uring_sqe *const sqe = consumer.get_sqe()) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = eventfd_descriptor;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = user_data;
+        watching = true;
+    }
+}
+
+inline void MsgRingNotifier::consume() {
+    // This fails with `EAGAIN` if the counter is zero, e.g. if the completion
+    // was a message rather than the poll, in which case the poll is still
+    // pending. Otherwise the poll has completed, or is about to.
+    std::uint64_t count;
+    if (read(eventfd_descriptor, &count, sizeof count) == sizeof count) {
+        watching = false;
+    }
+}
+
+inline std::uint64_t MsgRingNotifier::sender_user_data() const {
+    return reinterpret_cast<std::uintptr_t>(this);
+}
+
+inline bool MsgRingNotifier::handle_completion(const io_uring_cqe& completion) {
+    if (completion.user_data != sender_user_data()) {
+        return false;
+    }
+    if (completion.res < 0) {
+        signal_eventfd();
+    }
+    return true;
+}
+
+inline void MsgRingNotifier::fire() {
+    if (!uses_msg_ring()) {
+        signal_eventfd();
+        return;
+    }
+
+    if (IoUring *const ring = producers.local().ring) {
+        if (io_uring_sqe *const sqe = ring->get_sqe()) {
+            prepare_message(*sqe);
+            return;
+        }
+    }
+
+    // Send it now. This happens at most once per `arm`, so the lock is
+    // rarely contended.
+    std::lock_guard<std::mutex> lock(own_ring_mutex);
+    io_uring_sqe *const sqe = own_ring->get_sqe();
+    if (!sqe) {
+        signal_eventfd();
+        return;
+    }
+    prepare_message(*sqe);
+    // Wait for the result, whether or not the message succeeds, in the same
+    // system call that sends it.
+    sqe->flags = 0;
+    if (own_ring->submit(1) < 0) {
+        signal_eventfd();
+    }
+    io_uring_cqe completion;
+    while (own_ring->pop_completion(completion)) {
+        handle_completion(completion);
+    }
+}
+
+inline void MsgRingNotifier::prepare_message(io_uring_sqe& sqe) const {
+    sqe.opcode = IORING_OP_MSG_RING;
+    sqe.fd = consumer_ring;
+    sqe.addr = IORING_MSG_DATA;
+    // The consumer's completion gets `res` from `len` and `user_data` from
+    // `off`.
+    sqe.len = 0;
+    sqe.off = user_data;
+    sqe.user_data = sender_user_data();
+    // Don't post a completion to the sender's ring unless the message fails.
+    sqe.flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+inline void MsgRingNotifier::signal_eventfd() {
+    const std::uint64_t one = 1;
+    (void)!write(eventfd_descriptor, &one, sizeof one);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// This file contains `Notifier`, the hook through which a `Queue` wakes a
+// consumer that waits for it in some other way than polling, such as an
+// event loop blocked in `epoll_wait`. See `eventfd_notifier.h` for one.
+//
+// A consumer "arms" its notifier when it's about to wait, and the first push
+// after that "fires" it, which disarms it. Pushes while the notifier is
+// disarmed cost a load and nothing more, so a busy producer feeding a busy
+// consumer makes no system calls.
+
+#include <atomic>
+
+// `Notifier` is a base class. A derived class implements `fire()` to wake the
+// consumer, e.g. by writing to a file descriptor that it's polling.
+//
+// The consumer does this:
+//
+//     for (;;) {
+//         while (std::optional<T> element = queue.try_pop_front()) {
+//             handle(*element);
+//         }
+//         if (notifier.arm(queue)) {
+//             wait for the notification, e.g. with epoll_wait, and consume it
+//         }
+//     }
+//
+// `arm(queue)` checks the queue again after arming, which is what prevents
+// lost wakeups: either the producer sees the notifier armed, or the
+// consumer sees the producer's element. Like `EventCount`, this relies on
+// the queue's operations being sequentially consistent.
+class Notifier {
+    std::atomic<bool> armed;
+
+public:
+    Notifier();
+    virtual ~Notifier() = default;
+
+    Notifier(const Notifier&) = delete;
+    Notifier& operator=(const Notifier&) = delete;
+
+    // Called by producers after each push. Fire if armed.
+    void notify();
+
+    // Arm, unless `queue` has elements. Return whether the notifier was
+    // armed, in which case the consumer may wait for it to fire.
+    template <typename SomeQueue>
+    bool arm(const SomeQueue& queue);
+
+    // Disarm without firing, e.g. when the consumer stopped waiting for some
+    // other reason.
+    void disarm();
+
+protected:
+    // Wake the consumer. This is called at most once per `arm`.
+    virtual void fire() = 0;
+};
+
+inline Notifier::Notifier()
+: armed(false) {}
+
+inline void Notifier::notify() {
+    if (armed.load() && armed.exchange(false)) {
+        fire();
+    }
+}
+
+inline void Notifier::disarm() {
+    armed.store(false);
+}
+
+template <typename SomeQueue>
+bool Notifier::arm(const SomeQueue& queue) {
+    armed.store(true);
+    if (queue.empty()) {
+        return true;
+    }
+    // An element arrived meanwhile. If a producer disarmed us first, then
+    // it fired too, and the consumer will find a spurious notification.
+    armed.store(false);
+    return false;
+}
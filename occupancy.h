@@ -0,0 +1,82 @@
+#pragma once
+
+// This file contains `OccupancyCounter`, which tracks approximately how many
+// elements a queue holds, and the most it has held, without making pushes or
+// pops contend on a shared counter.
+
+#include "per_thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// `OccupancyCounter` keeps a count of pushes and a count of pops per thread,
+// in a `PerThread`. Only the owning thread writes its counts, so each push or
+// pop is a load and a store (see `bump`) to memory that no other thread
+// writes. The size is the sum of all pushes less the sum of all pops. Since
+// the counts are read one thread at a time while they're changing, the sum
+// is approximate, and reading it costs time proportional to the number of
+// threads that have used the queue.
+//
+// The high-water mark is the largest size observed. It's updated whenever
+// `size()` is called, and by each pushing thread every `high_water_period`
+// of its pushes, so that peaks between readings aren't entirely missed.
+class OccupancyCounter {
+    struct Record {
+        std::atomic<std::uint64_t> pushes = 0;
+        std::atomic<std::uint64_t> pops = 0;
+        // Pushes until this thread next updates the high-water mark.
+        std::uint32_t countdown = 0;
+    };
+
+    PerThread<Record> records;
+    mutable std::atomic<std::int64_t> high_water;
+
+public:
+    static constexpr std::uint32_t high_water_period = 256;
+
+    OccupancyCounter();
+
+    void pushed();
+    void popped();
+
+    // Return the approximate number of elements, and update the high-water
+    // mark with it.
+    std::int64_t size() const;
+    std::int64_t high_water_mark() const;
+};
+
+inline OccupancyCounter::OccupancyCounter()
+: high_water(0) {}
+
+inline void OccupancyCounter::pushed() {
+    Record& record = records.local();
+    bump(record.pushes);
+    if (record.countdown-- == 0) {
+        record.countdown = high_water_period - 1;
+        (void)size();
+    }
+}
+
+inline void OccupancyCounter::popped() {
+    bump(records.local().pops);
+}
+
+inline std::int64_t OccupancyCounter::size() const {
+    std::int64_t total = 0;
+    records.for_each([&](const Record& record) {
+        total += std::int64_t(record.pushes.load(std::memory_order_relaxed))
+            - std::int64_t(record.pops.load(std::memory_order_relaxed));
+    });
+    // A pop can be counted before the push it popped, if the two threads'
+    // counts were read at different times.
+    total = std::max<std::int64_t>(total, 0);
+
+    std::int64_t old_high = high_water.load(std::memory_order_relaxed);
+    while (total > old_high && !high_water.compare_exchange_weak(old_high, total, std::memory_order_relaxed)) {}
+    return total;
+}
+
+inline std::int64_t OccupancyCounter::high_water_mark() const {
+    return high_water.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,234 @@
+// This program is an open-loop load generator. Unlike the closed-loop
+// benchmarks, where each thread pushes as fast as the queue lets it,
+// producers here push at a target arrival rate, regardless of how the queue
+// is keeping up.
+//
+// Each element carries the time at which it was *scheduled* to be pushed.
+// Consumers measure each element's sojourn time from that scheduled time,
+// rather than from when `push_back` actually happened. If a producer falls
+// behind schedule (e.g. because `push_back` stalled), then the elements it
+// pushes late are charged for the lateness. This corrects for "coordinated
+// omission," where a stalled closed-loop client stops generating the very
+// requests that would have observed the stall.
+//
+// The program sweeps the offered load, doubling it each step, and reports
+// the achieved throughput and sojourn time percentiles at each load. The
+// "knee" is the first load at which the system can't keep up: achieved
+// throughput falls below 95% of offered, or the 99th percentile sojourn
+// time exceeds ten times its value at the lowest load.
+
+#include "bench.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct OpenLoopConfig {
+    // Offered loads, in elements per second, summed over producers. If empty,
+    // sweep from `first_rate` doubling until past the knee.
+    std::vector<double> rates;
+    double first_rate = 100'000;
+    double max_rate = 1e9;
+    double seconds = 1;
+    // Whether inter-arrival times are exponentially distributed (a Poisson
+    // process) rather than constant.
+    bool poisson = false;
+    int producers = 1;
+    int consumers = 1;
+    // Name of the engine to load, or "all".
+    std::string engine = "Queue";
+};
+
+OpenLoopConfig parse_args(int argc, char *argv[]) {
+    OpenLoopConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--rate N[,N...]] [--duration SECONDS] [--poisson]"
+                     " [--producers N] [--consumers N] [ENGINE | all]\n";
+        std::exit(2);
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--rate" && i + 1 < argc) {
+            const std::string list = argv[++i];
+            for (std::size_t begin = 0; begin < list.size();) {
+                std::size_t end = list.find(',', begin);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                config.rates.push_back(std::atof(list.substr(begin, end - begin).c_str()));
+                begin = end + 1;
+            }
+        } else if (arg == "--duration" && i + 1 < argc) {
+            config.seconds = std::atof(argv[++i]);
+        } else if (arg == "--poisson") {
+            config.poisson = true;
+        } else if (arg == "--producers" && i + 1 < argc) {
+            config.producers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--consumers" && i + 1 < argc) {
+            config.consumers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg.rfind("--", 0) == 0) {
+            usage();
+        } else {
+            config.engine = arg;
+        }
+    }
+    if (!selects_engine(config.engine)) {
+        std::cerr << "unknown engine: " << config.engine << '\n';
+        usage();
+    }
+    return config;
+}
+
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// `Stamped` is the element type. `scheduled_ns` is when the element was
+// supposed to be pushed.
+struct Stamped {
+    std::int64_t scheduled_ns;
+};
+
+struct LoadResult {
+    double offered;
+    double achieved;
+    // Sojourn times from scheduled push to pop, in nanoseconds.
+    LatencyHistogram sojourn;
+    // How late producers were in pushing, in nanoseconds.
+    LatencyHistogram lateness;
+};
+
+template <typename SomeQueue>
+LoadResult run_load(SomeQueue& queue, const OpenLoopConfig& config, double rate) {
+    const double per_producer_rate = rate / config.producers;
+    const long per_producer = std::max(1L, long(per_producer_rate * config.seconds));
+    const long total = per_producer * config.producers;
+
+    std::vector<LatencyHistogram> sojourns(config.consumers);
+    std::vector<LatencyHistogram> lateness(config.producers);
+    std::vector<std::int64_t> finish_ns(config.consumers);
+    std::atomic<std::int64_t> start_ns(0);
+
+    run_threads(config.producers + config.consumers, [&](int i) {
+        if (i == 0) {
+            start_ns.store(now_ns() + 1'000'000); // start in a millisecond
+        }
+        std::int64_t start;
+        while ((start = start_ns.load()) == 0) {}
+
+        if (i < config.producers) {
+            std::mt19937_64 random(i);
+            std::exponential_distribution<double> exponential(per_producer_rate);
+            const double interval_ns = 1e9 / per_producer_rate;
+            double scheduled = double(start);
+            for (long j = 0; j < per_producer; ++j) {
+                scheduled += config.poisson ? exponential(random) * 1e9 : interval_ns;
+                std::int64_t now;
+                while ((now = now_ns()) < std::int64_t(scheduled)) {
+                    // Give up the CPU while well ahead of schedule, in case
+                    // it's shared with a consumer.
+                    if (std::int64_t(scheduled) - now > 50'000) {
+                        std::this_thread::yield();
+                    }
+                }
+                lateness[i].record(std::uint64_t(now - std::int64_t(scheduled)));
+                queue.push_back(Stamped{std::int64_t(scheduled)});
+            }
+            return;
+        }
+
+        const int consumer = i - config.producers;
+        const long quota = total / config.consumers + (consumer < total % config.consumers);
+        for (long popped = 0; popped < quota;) {
+            if (const std::optional<Stamped> element = queue.try_pop_front()) {
+                const std::int64_t now = now_ns();
+                sojourns[consumer].record(std::uint64_t(std::max<std::int64_t>(0, now - element->scheduled_ns)));
+                ++popped;
+                finish_ns[consumer] = now;
+            }
+        }
+    });
+
+    LoadResult result{rate, 0, {}, {}};
+    for (const LatencyHistogram& histogram : sojourns) {
+        result.sojourn.merge(histogram);
+    }
+    for (const LatencyHistogram& histogram : lateness) {
+        result.lateness.merge(histogram);
+    }
+    // The elements were scheduled over `per_producer / per_producer_rate`
+    // seconds. If popping them all took longer, the system fell behind.
+    const double scheduled_seconds = per_producer / per_producer_rate;
+    const std::int64_t last_pop_ns = *std::max_element(finish_ns.begin(), finish_ns.end());
+    const double elapsed_seconds = std::max(scheduled_seconds, (last_pop_ns - start_ns.load()) / 1e9);
+    result.achieved = total / elapsed_seconds;
+    return result;
+}
+
+void print_load(const LoadResult& result, bool knee) {
+    const auto us = [](std::uint64_t ns) { return ns / 1e3; };
+    std::cout << std::fixed << std::setprecision(0)
+              << std::setw(12) << result.offered << std::setw(12) << result.achieved
+              << std::setprecision(1)
+              << std::setw(10) << us(result.sojourn.value_at(0.50))
+              << std::setw(10) << us(result.sojourn.value_at(0.99))
+              << std::setw(10) << us(result.sojourn.value_at(0.999))
+              << std::setw(12) << us(result.sojourn.max())
+              << std::setw(12) << us(result.lateness.value_at(0.99))
+              << (knee ? "  <- knee" : "")
+              << std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+template <template <typename> class Q>
+void sweep(const OpenLoopConfig& config) {
+    std::cout << EngineTraits<Q>::name << ": " << config.producers << " producer(s), "
+              << config.consumers << " consumer(s), " << (config.poisson ? "Poisson" : "constant")
+              << " arrivals, " << config.seconds << "s per load\n"
+              << std::setw(12) << "offered/s" << std::setw(12) << "achieved/s"
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "p99.9 us"
+              << std::setw(12) << "max us" << std::setw(12) << "late p99 us" << '\n';
+
+    std::vector<double> rates = config.rates;
+    const bool searching = rates.empty();
+    if (searching) {
+        for (double rate = config.first_rate; rate <= config.max_rate; rate *= 2) {
+            rates.push_back(rate);
+        }
+    }
+
+    double baseline_p99 = 0;
+    for (const double rate : rates) {
+        const auto queue = EngineTraits<Q>::template make<Stamped>(1 << 16);
+        const LoadResult result = run_load(*queue, config, rate);
+        const double p99 = result.sojourn.value_at(0.99);
+        if (baseline_p99 == 0) {
+            baseline_p99 = std::max(1.0, p99);
+        }
+        const bool knee = result.achieved < 0.95 * rate || p99 > 10 * baseline_p99;
+        print_load(result, knee);
+        if (knee && searching) {
+            break;
+        }
+    }
+    std::cout << '\n';
+}
+
+int main(int argc, char *argv[]) {
+    const OpenLoopConfig config = parse_args(argc, argv);
+    for_each_engine([&]<template <typename> class Q>() {
+        if (config.engine == "all" || config.engine == EngineTraits<Q>::name) {
+            sweep<Q>(config);
+        }
+    });
+}
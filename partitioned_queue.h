@@ -0,0 +1,227 @@
+#pragma once
+
+// This file contains `PartitionedQueue`, which preserves the order of
+// elements that share a key, e.g. all of the events for one account, while
+// letting many consumers process elements with different keys in parallel.
+//
+// With a plain `Queue`, two consumers can pop consecutive elements for the
+// same key, and then process them in either order. `PartitionedQueue` hashes
+// each key to one of a fixed number of partitions, and only the consumer
+// that has claimed a partition pops from it. So all of a key's elements go
+// through one consumer at a time, in order.
+
+#include "lock_free_queue.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// `PartitionedQueue<Key, T, Hash>` has a fixed number of partitions, each a
+// `Queue<T>` with a flag saying whether a consumer has claimed it. Any
+// thread may `push_back(key, value)`. A consumer claims a partition that has
+// elements by setting its flag with a compare-and-swap, pops and processes
+// as many elements as it likes, and then releases the partition by clearing
+// the flag:
+//
+//     PartitionedQueue<AccountId, Event> events(64);
+//     for (;;) {
+//         if (auto claim = events.try_claim()) {
+//             while (std::optional<Event> event = claim->try_pop_front()) {
+//                 process(*event);
+//             }
+//         } // Destroying the claim releases the partition.
+//     }
+//
+// or, equivalently, `events.try_process(process)`. Elements must be
+// processed before the partition is released, or else the next consumer to
+// claim it could overtake them.
+//
+// Claiming scans the partitions for one that is unclaimed and nonempty,
+// starting from a different partition each time so that consumers spread
+// out and no partition is starved. Where to start is kept per thread, so
+// that a claim writes to no shared memory unless it finds a partition. A
+// scan that finds nothing costs a load or two per partition, so a few times
+// as many partitions as consumers is plenty. Keys that hash to the same
+// partition are serialized with each other, so more partitions means more
+// parallelism among busy keys.
+template <typename Key, typename T, typename Hash = std::hash<Key>>
+class PartitionedQueue {
+    struct Partition {
+        Queue<T> queue;
+        std::atomic<bool> claimed;
+
+        Partition()
+        : claimed(false) {}
+    };
+
+    const std::size_t n_partitions;
+    const std::unique_ptr<Partition[]> partitions;
+    [[no_unique_address]] Hash hash;
+
+public:
+    // `Claim` is a consumer's exclusive hold on one partition. It releases
+    // the partition when destroyed.
+    class Claim {
+        Partition *claimed;
+        std::size_t index;
+
+    public:
+        Claim(Partition& partition, std::size_t index);
+        Claim(Claim&& other) noexcept;
+        ~Claim();
+
+        Claim(const Claim&) = delete;
+        Claim& operator=(const Claim&) = delete;
+        Claim& operator=(Claim&&) = delete;
+
+        // Return the index of the claimed partition.
+        std::size_t partition() const;
+
+        // Pop the claimed partition's front element, if any.
+        std::optional<T> try_pop_front();
+    };
+
+    // Create a queue with `n_partitions` partitions, which must be positive.
+    explicit PartitionedQueue(std::size_t n_partitions, Hash hash = Hash());
+
+    PartitionedQueue(const PartitionedQueue&) = delete;
+    PartitionedQueue& operator=(const PartitionedQueue&) = delete;
+
+    std::size_t size() const;
+
+    // Return the partition that `key` is pushed into.
+    std::size_t partition_of(const Key& key) const;
+
+    template <typename Value>
+    void push_back(const Key& key, Value&& value);
+
+    // Claim an unclaimed partition that has elements, or return null if there
+    // is none.
+    std::optional<Claim> try_claim();
+
+    // Claim a partition, pop at most `max_elements` elements from it,
+    // passing each to `handle`, and release it. Return how many elements
+    // were handled.
+    template <typename Handler>
+    std::size_t try_process(Handler&& handle, std::size_t max_elements = SIZE_MAX);
+
+    // Return whether every partition is empty.
+    bool empty() const;
+
+private:
+    // Return where the calling thread's next scan starts, modulo the number
+    // of partitions. Each thread starts one past where it started last, and
+    // threads begin at different offsets.
+    static std::size_t next_scan();
+};
+
+template <typename Key, typename T, typename Hash>
+PartitionedQueue<Key, T, Hash>::Claim::Claim(Partition& partition, std::size_t index)
+: claimed(&partition)
+, index(index) {}
+
+template <typename Key, typename T, typename Hash>
+PartitionedQueue<Key, T, Hash>::Claim::Claim(Claim&& other) noexcept
+: claimed(std::exchange(other.claimed, nullptr))
+, index(other.index) {}
+
+template <typename Key, typename T, typename Hash>
+PartitionedQueue<Key, T, Hash>::Claim::~Claim() {
+    if (claimed) {
+        claimed->claimed.store(false);
+    }
+}
+
+template <typename Key, typename T, typename Hash>
+std::size_t PartitionedQueue<Key, T, Hash>::Claim::partition() const {
+    return index;
+}
+
+template <typename Key, typename T, typename Hash>
+std::optional<T> PartitionedQueue<Key, T, Hash>::Claim::try_pop_front() {
+    return claimed->queue.try_pop_front();
+}
+
+template <typename Key, typename T, typename Hash>
+PartitionedQueue<Key, T, Hash>::PartitionedQueue(std::size_t n_partitions, Hash hash)
+: n_partitions(n_partitions)
+, partitions(new Partition[n_partitions])
+, hash(std::move(hash)) {
+    assert(n_partitions > 0);
+}
+
+template <typename Key, typename T, typename Hash>
+std::size_t PartitionedQueue<Key, T, Hash>::size() const {
+    return n_partitions;
+}
+
+template <typename Key, typename T, typename Hash>
+std::size_t PartitionedQueue<Key, T, Hash>::partition_of(const Key& key) const {
+    return hash(key) % n_partitions;
+}
+
+template <typename Key, typename T, typename Hash>
+template <typename Value>
+void PartitionedQueue<Key, T, Hash>::push_back(const Key& key, Value&& value) {
+    partitions[partition_of(key)].queue.push_back(std::forward<Value>(value));
+}
+
+template <typename Key, typename T, typename Hash>
+std::optional<typename PartitionedQueue<Key, T, Hash>::Claim> PartitionedQueue<Key, T, Hash>::try_claim() {
+    const std::size_t start = next_scan();
+    for (std::size_t i = 0; i < n_partitions; ++i) {
+        const std::size_t index = (start + i) % n_partitions;
+        Partition& partition = partitions[index];
+        // Check before the compare-and-swap, so that scanning past claimed
+        // or empty partitions doesn't write to them.
+        if (partition.claimed.load() || partition.queue.empty()) {
+            continue;
+        }
+        bool expected = false;
+        if (partition.claimed.compare_exchange_strong(expected, true)) {
+            return Claim(partition, index);
+        }
+    }
+    return std::nullopt;
+}
+
+template <typename Key, typename T, typename Hash>
+template <typename Handler>
+std::size_t PartitionedQueue<Key, T, Hash>::try_process(Handler&& handle, std::size_t max_elements) {
+    std::optional<Claim> claim = try_claim();
+    if (!claim) {
+        return 0;
+    }
+    std::size_t n_handled = 0;
+    while (n_handled < max_elements) {
+        std::optional<T> element = claim->try_pop_front();
+        if (!element) {
+            break;
+        }
+        handle(std::move(*element));
+        ++n_handled;
+    }
+    return n_handled;
+}
+
+template <typename Key, typename T, typename Hash>
+std::size_t PartitionedQueue<Key, T, Hash>::next_scan() {
+    static std::atomic<std::size_t> n_threads(0);
+    static thread_local std::size_t start = n_threads.fetch_add(1, std::memory_order_relaxed);
+    return start++;
+}
+
+template <typename Key, typename T, typename Hash>
+bool PartitionedQueue<Key, T, Hash>::empty() const {
+    for (std::size_t i = 0; i < n_partitions; ++i) {
+        if (!partitions[i].queue.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
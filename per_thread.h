@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+// Add `amount` to `counter`, which only the calling thread writes, e.g.
+// because it's in the thread's own `PerThread` record. With a single writer,
+// a relaxed load and store can't lose an update, and they're cheaper than a
+// read-modify-write, which would lock the cache line. Other threads may read
+// `counter` concurrently, and see either the old or the new value.
+inline void bump(std::atomic<std::uint64_t>& counter, std::uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// `PerThread<T>` gives each thread that calls `local()` its own `T`, and lets
+// any thread visit all of the `T`s with `for_each`.
+//
+// The `T`s live in "records" that form a singly linked list. A thread
+// allocates its record the first time it calls `local()` on a given
+// `PerThread`, and pushes the record onto the front of the list. After that,
+// the thread finds its record again through a `thread_local` cache, so
+// `local()` touches no shared atomics once a thread is registered. Finding
+// the record costs a comparison if it's the `PerThread` the thread used
+// last, and otherwise a scan of the thread's entries for the `PerThread`s it
+// has used that still exist.
+//
+// Records are not reclaimed when their thread exits. They live as long as
+// the `PerThread` does. This keeps `for_each` simple, and is fine for the
+// long-lived worker threads this is meant for.
+//
+// `T` must be default constructible. Since `for_each` can visit a record
+// while its owner is using it, any part of `T` that is read by other threads
+// must be safe to read concurrently (e.g. be atomic).
+template <typename T>
+class PerThread {
+    struct alignas(64) Record {
+        T value;
+        Record *next = nullptr;
+    };
+
+    std::atomic<Record*> records;
+    // `id` distinguishes this `PerThread` from every other `PerThread` that
+    // ever existed, even one that previously occupied the same address.
+    const std::uint64_t id;
+
+public:
+    PerThread();
+    ~PerThread();
+
+    PerThread(const PerThread&) = delete;
+    PerThread& operator=(const PerThread&) = delete;
+
+    // Return the calling thread's `T`, creating it if necessary.
+    T& local();
+
+    // Invoke `visitor(T&)` for each thread's `T`, in no particular order.
+    // If `visitor` returns `bool`, then stop visiting once it returns `true`,
+    // and return whether that happened.
+    template <typename Visitor>
+    bool for_each(Visitor&& visitor);
+    template <typename Visitor>
+    bool for_each(Visitor&& visitor) const;
+
+private:
+    struct CacheEntry {
+        std::uint64_t owner_id;
+        Record *record;
+    };
+
+    struct Cache {
+        CacheEntry last = {0, nullptr};
+        // This has one entry per `PerThread` that the thread has used. Entries
+        // for destroyed `PerThread`s are never matched again, since `id`s are
+        // not reused, and they're removed the next time the thread registers
+        // with a `PerThread`, which is the only time the list grows.
+        std::vector<CacheEntry> entries;
+        // `Registry::n_destroyed` as of the last removal.
+        std::uint64_t n_destroyed_seen = 0;
+    };
+
+    // `Registry` knows which `PerThread<T>`s still exist, so that threads can
+    // drop their cache entries for the others.
+    struct Registry {
+        std::mutex mutex;
+        std::unordered_set<std::uint64_t> live_ids;
+        std::atomic<std::uint64_t> n_destroyed = 0;
+    };
+
+    static Cache& cache();
+    static Registry& registry();
+    static std::uint64_t next_id();
+
+    T& register_thread(Cache&);
+
+    template <typename Visitor, typename Value>
+    static bool visit(Visitor& visitor, Value& value);
+};
+
+template <typename T>
+PerThread<T>::PerThread()
+: records(nullptr)
+, id(next_id()) {
+    Registry& live = registry();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.live_ids.insert(id);
+}
+
+template <typename T>
+PerThread<T>::~PerThread() {
+    Registry& live = registry();
+    {
+        std::lock_guard<std::mutex> lock(live.mutex);
+        live.live_ids.erase(id);
+    }
+    live.n_destroyed.fetch_add(1);
+
+    Record *next;
+    for (Record *record = records.load(); record; record = next) {
+        next = record->next;
+        delete record;
+    }
+}
+
+template <typename T>
+T& PerThread<T>::local() {
+    Cache& entries = cache();
+    if (entries.last.owner_id == id) {
+        return entries.last.record->value;
+    }
+    for (const CacheEntry& entry : entries.entries) {
+        if (entry.owner_id == id) {
+            entries.last = entry;
+            return entry.record->value;
+        }
+    }
+    return register_thread(entries);
+}
+
+template <typename T>
+template <typename Visitor>
+bool PerThread<T>::for_each(Visitor&& visitor) {
+    for (Record *record = records.load(); record; record = record->next) {
+        if (visit(visitor, record->value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T>
+template <typename Visitor>
+bool PerThread<T>::for_each(Visitor&& visitor) const {
+    for (const Record *record = records.load(); record; record = record->next) {
+        if (visit(visitor, record->value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T>
+typename PerThread<T>::Cache& PerThread<T>::cache() {
+    // One per thread for each `T`, shared by all `PerThread<T>` objects.
+    static thread_local Cache instance;
+    return instance;
+}
+
+template <typename T>
+typename PerThread<T>::Registry& PerThread<T>::registry() {
+    // Never destroyed, so that `PerThread`s with static storage duration can
+    // still use it in their destructors.
+    static Registry *const instance = new Registry;
+    return *instance;
+}
+
+template <typename T>
+std::uint64_t PerThread<T>::next_id() {
+    static std::atomic<std::uint64_t> counter(1);
+    return counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T>
+T& PerThread<T>::register_thread(Cache& entries) {
+    Record *record = new Record;
+    Record *old_records = records.load();
+    do {
+        record->next = old_records;
+    } while (!records.compare_exchange_weak(old_records, record));
+
+    // Drop entries for `PerThread`s destroyed since the last time, so that
+    // the cache doesn't grow with every `PerThread` the thread ever used.
+    Registry& live = registry();
+    const std::uint64_t n_destroyed = live.n_destroyed.load();
+    if (n_destroyed != entries.n_destroyed_seen) {
+        std::lock_guard<std::mutex> lock(live.mutex);
+        std::erase_if(entries.entries, [&](const CacheEntry& entry) {
+            return !live.live_ids.count(entry.owner_id);
+        });
+        entries.n_destroyed_seen = n_destroyed;
+    }
+
+    entries.last = CacheEntry{id, record};
+    entries.entries.push_back(entries.last);
+    return record->value;
+}
+
+template <typename T>
+template <typename Visitor, typename Value>
+bool PerThread<T>::visit(Visitor& visitor, Value& value) {
+    if constexpr (std::is_same_v<decltype(visitor(value)), bool>) {
+        return visitor(value);
+    } else {
+        visitor(value);
+        return false;
+    }
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+// This file contains `PerfCounters`, a set of hardware performance counters
+// read through Linux's `perf_event_open`, for use by the benchmark harness.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// `PerfCounters` counts hardware events in the calling thread and in every
+// thread that it (or its descendants) creates after the `PerfCounters` is
+// constructed. Counting happens only between `start()` and `stop()`, and
+// accumulates over multiple start/stop intervals.
+//
+// Events that the kernel or CPU doesn't support, or that the process isn't
+// allowed to count (see `/proc/sys/kernel/perf_event_paranoid`), are left out.
+// `error()` describes why the first such event couldn't be opened.
+class PerfCounters {
+public:
+    struct Count {
+        std::string name;
+        // The count, scaled up to account for time the counter spent
+        // multiplexed out, if any.
+        double value;
+    };
+
+private:
+    struct Counter {
+        const char *name;
+        int fd;
+    };
+
+    std::vector<Counter> counters;
+    std::string first_error;
+
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Return whether any event could be opened.
+    bool available() const;
+    const std::string& error() const;
+
+    void start();
+    void stop();
+    // Return the current count of each opened event.
+    std::vector<Count> read() const;
+
+private:
+    void open(const char *name, std::uint32_t type, std::uint64_t config);
+    static std::uint64_t cache_event(std::uint64_t cache, std::uint64_t op, std::uint64_t result);
+    // Return whether raw event `0x04d2` is `MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM`
+    // on this CPU.
+    static bool has_hitm_event();
+};
+
+inline PerfCounters::PerfCounters() {
+    open("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    open("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    open("L1d-misses", PERF_TYPE_HW_CACHE,
+        cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    open("LLC-misses", PERF_TYPE_HW_CACHE,
+        cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    open("dTLB-misses", PERF_TYPE_HW_CACHE,
+        cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    // Loads that hit a line modified in another core's cache, i.e. cache line
+    // transfers. There is no generic event for this. This is Intel's
+    // `MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM`, which has this encoding only on
+    // some CPUs. Elsewhere the raw event counts something else, so it's not
+    // opened at all, and "HITM" is missing from the counts.
+    if (has_hitm_event()) {
+        std::string first_error_so_far = first_error;
+        open("HITM", PERF_TYPE_RAW, 0x04d2);
+        // Lack of this event alone doesn't mean that counters are unavailable.
+        first_error = first_error_so_far;
+    }
+}
+
+inline PerfCounters::~PerfCounters() {
+    for (const Counter& counter : counters) {
+        close(counter.fd);
+    }
+}
+
+inline bool PerfCounters::available() const {
+    return !counters.empty();
+}
+
+inline const std::string& PerfCounters::error() const {
+    return first_error;
+}
+
+inline void PerfCounters::start() {
+    for (const Counter& counter : counters) {
+        ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+inline void PerfCounters::stop() {
+    for (const Counter& counter : counters) {
+        ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+inline std::vector<PerfCounters::Count> PerfCounters::read() const {
+    std::vector<Count> result;
+    for (const Counter& counter : counters) {
+        // See `PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING`
+        // in `open`.
+        std::uint64_t values[3] = {};
+        if (::read(counter.fd, values, sizeof values) != sizeof values) {
+            continue;
+        }
+        const double scale = values[2] ? double(values[1]) / values[2] : 0;
+        result.push_back(Count{counter.name, values[0] * scale});
+    }
+    return result;
+}
+
+inline void PerfCounters::open(const char *name, std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    const int fd = int(syscall(SYS_perf_event_open, &attr, 0 /*this process*/, -1 /*any CPU*/, -1 /*no group*/, 0));
+    if (fd == -1) {
+        if (first_error.empty()) {
+            first_error = std::string(name) + ": " + std::strerror(errno);
+        }
+        return;
+    }
+    counters.push_back(Counter{name, fd});
+}
+
+inline std::uint64_t PerfCounters::cache_event(std::uint64_t cache, std::uint64_t op, std::uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+inline bool PerfCounters::has_hitm_event() {
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    // The vendor string is in EBX, EDX, ECX, in that order.
+    const unsigned genuine_intel[] = {0x756e6547, 0x49656e69, 0x6c65746e};
+    if (ebx != genuine_intel[0] || edx != genuine_intel[1] || ecx != genuine_intel[2]) {
+        return false;
+    }
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    const unsigned family = (eax >> 8) & 0xf;
+    const unsigned model = ((eax >> 12) & 0xf0) | ((eax >> 4) & 0xf);
+    if (family != 6) {
+        return false;
+    }
+    switch (model) {
+    case 0x4e: case 0x5e: // Skylake
+    case 0x55:            // Skylake-SP, Cascade Lake, Cooper Lake
+    case 0x8e: case 0x9e: // Kaby Lake, Coffee Lake, Whiskey Lake
+    case 0xa5: case 0xa6: // Comet Lake
+    case 0x7d: case 0x7e: // Ice Lake
+    case 0x6a: case 0x6c: // Ice Lake-SP
+    case 0x8c: case 0x8d: // Tiger Lake
+    case 0xa7:            // Rocket Lake
+        return true;
+    default:
+        return false;
+    }
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+// This file contains `PriorityLanesQueue`, a queue with several priority
+// levels ("lanes") behind one object, so that a consumer finds the most
+// urgent element with one pop instead of polling one `Queue` per priority.
+
+#include "lock_free_queue.h"
+#include "per_thread.h"
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+// `PriorityLanesQueue<T, N>` has `N` lanes, each a `Queue<T>`, numbered from
+// zero (most urgent) to `N - 1` (least urgent). `push_back` takes the lane to
+// push into, and `try_pop_front` pops from the most urgent lane that has
+// elements. Elements in the same lane come out in order, as from a `Queue`.
+//
+// Which lanes might have elements is kept in a bitmap, one bit per lane, so
+// that a pop finds its lane by counting the trailing zeros of one word
+// (`tzcnt` on x86) rather than by trying each lane. A push sets its lane's
+// bit if it isn't already set. A pop that finds its lane empty clears the
+// bit, and then sets it again if the lane got an element meanwhile. So a
+// bit can be set while its lane is empty, which costs the next pop a retry,
+// but it's never clear while its lane has an element that's been pushed
+// and not yet popped.
+//
+// Strict priority starves the less urgent lanes while the more urgent ones
+// are busy. To prevent that, construct the queue with a `rotation_period`
+// of `k`. Then every `k`th pop by each consumer thread takes from the next
+// nonempty lane after the one it rotated to last, cyclically, instead of
+// from the most urgent. So the most urgent lanes get at least `(k - 1) / k`
+// of a busy consumer's pops, and every nonempty lane gets at least
+// `1 / (k * N)` of them.
+template <typename T, std::size_t N>
+class PriorityLanesQueue {
+    static_assert(N >= 1 && N <= 64, "lanes are bits of a 64-bit word");
+
+    // Each consumer's count of pops and the lane it rotated to last.
+    struct Rotation {
+        std::uint64_t pops = 0;
+        std::size_t lane = N - 1;
+    };
+
+    Queue<T> lanes[N];
+    alignas(64) std::atomic<std::uint64_t> occupied;
+    const std::uint64_t rotation_period;
+    PerThread<Rotation> rotations;
+
+public:
+    static constexpr std::size_t n_lanes = N;
+
+    // Serve lanes in strict priority order, unless `rotation_period` is
+    // positive, in which case every `rotation_period`th pop by a thread
+    // rotates among the nonempty lanes, as described above.
+    explicit PriorityLanesQueue(std::uint64_t rotation_period = 0);
+
+    // Push `value` into `lane`, which must be less than `N`.
+    template <typename Value>
+    void push_back(std::size_t lane, Value&& value);
+
+    std::optional<T> try_pop_front();
+    // Like `try_pop_front()`, but also set `lane` to the lane popped from, if
+    // any.
+    std::optional<T> try_pop_front(std::size_t& lane);
+
+    // Return whether every lane is empty.
+    bool empty() const;
+
+    // Return the lane at `lane`, e.g. for its `size_approx()` or `stats()`.
+    const Queue<T>& at(std::size_t lane) const;
+
+private:
+    // Return which lane to try next, given a nonzero `mask` of occupied
+    // lanes.
+    std::size_t choose(std::uint64_t mask);
+};
+
+template <typename T, std::size_t N>
+PriorityLanesQueue<T, N>::PriorityLanesQueue(std::uint64_t rotation_period)
+: occupied(0)
+, rotation_period(rotation_period) {}
+
+template <typename T, std::size_t N>
+template <typename Value>
+void PriorityLanesQueue<T, N>::push_back(std::size_t lane, Value&& value) {
+    assert(lane < N);
+    lanes[lane].push_back(std::forward<Value>(value));
+    // If the bit is already set, then either a pop will see this element, or
+    // a pop that clears the bit will see the lane nonempty and set it again.
+    const std::uint64_t bit = std::uint64_t(1) << lane;
+    if (!(occupied.load() & bit)) {
+        occupied.fetch_or(bit);
+    }
+}
+
+template <typename T, std::size_t N>
+std::optional<T> PriorityLanesQueue<T, N>::try_pop_front() {
+    std::size_t lane;
+    return try_pop_front(lane);
+}
+
+template <typename T, std::size_t N>
+std::optional<T> PriorityLanesQueue<T, N>::try_pop_front(std::size_t& lane) {
+    for (std::uint64_t mask; (mask = occupied.load());) {
+        const std::size_t candidate = choose(mask);
+        if (std::optional<T> result = lanes[candidate].try_pop_front()) {
+            lane = candidate;
+            return result;
+        }
+        // The lane is empty. Clear its bit, unless it got an element since.
+        const std::uint64_t bit = std::uint64_t(1) << candidate;
+        occupied.fetch_and(~bit);
+        if (!lanes[candidate].empty()) {
+            occupied.fetch_or(bit);
+        }
+    }
+    return std::nullopt;
+}
+
+template <typename T, std::size_t N>
+bool PriorityLanesQueue<T, N>::empty() const {
+    for (std::uint64_t mask = occupied.load(); mask; mask &= mask - 1) {
+        if (!lanes[std::countr_zero(mask)].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T, std::size_t N>
+const Queue<T>& PriorityLanesQueue<T, N>::at(std::size_t lane) const {
+    assert(lane < N);
+    return lanes[lane];
+}
+
+template <typename T, std::size_t N>
+std::size_t PriorityLanesQueue<T, N>::choose(std::uint64_t mask) {
+    if (!rotation_period) {
+        return std::countr_zero(mask);
+    }
+    Rotation& rotation = rotations.local();
+    if (++rotation.pops % rotation_period) {
+        return std::countr_zero(mask);
+    }
+    // Find the first occupied lane after `rotation.lane`, wrapping around.
+    // Bits at and above `N` are never set, so rotating the whole word works.
+    const int shift = int((rotation.lane + 1) % 64);
+    rotation.lane = (std::countr_zero(std::rotr(mask, shift)) + shift) % 64;
+    return rotation.lane;
+}
@@ -0,0 +1,504 @@
+#pragma once
+
+// This file contains the optional instrumentation that `Queue` carries.
+//
+// Each kind of instrumentation is a class template with a `bool` parameter.
+// The `true` specialization does the work, while the `false` specialization
+// has the same interface but is empty and does nothing, so that calls to it
+// compile away. `Queue` chooses between them based on a preprocessor macro,
+// which means the hooks can stay in production builds at no cost.
+//
+// - `LatencyRecorder`: define `LOCK_FREE_QUEUE_LATENCY` to record sampled
+//   operation latencies into per-thread histograms. See `Queue::latency()`.
+// - `ContentionCounters`: define `LOCK_FREE_QUEUE_STATS` to count attempts,
+//   failures and bails at each compare-and-swap site, and node allocations
+//   and free list hits and misses. See `Queue::stats()`.
+// - `FairnessRecorder`: define `LOCK_FREE_QUEUE_FAIRNESS` to record, per
+//   thread, successful operations, the longest run of compare-and-swap
+//   failures within one operation, and how long operations took to succeed.
+//   See `Queue::fairness()`.
+// - `UsdtProbes`: define `LOCK_FREE_QUEUE_USDT` to place USDT probes (see
+//   `usdt.h`) in `Queue`'s hot paths, for tracing with bpftrace and the like.
+//   Unlike the others, these cost only a `nop` each until a tracer attaches.
+
+#include "latency.h"
+#include "per_thread.h"
+#include "usdt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef LOCK_FREE_QUEUE_LATENCY
+inline constexpr bool queue_latency_enabled = true;
+#else
+inline constexpr bool queue_latency_enabled = false;
+#endif
+
+#ifdef LOCK_FREE_QUEUE_STATS
+inline constexpr bool queue_stats_enabled = true;
+#else
+inline constexpr bool queue_stats_enabled = false;
+#endif
+
+#ifdef LOCK_FREE_QUEUE_FAIRNESS
+inline constexpr bool queue_fairness_enabled = true;
+#else
+inline constexpr bool queue_fairness_enabled = false;
+#endif
+
+#ifdef LOCK_FREE_QUEUE_USDT
+inline constexpr bool queue_usdt_enabled = true;
+#else
+inline constexpr bool queue_usdt_enabled = false;
+#endif
+
+// Only one in every `LOCK_FREE_QUEUE_LATENCY_SAMPLE_PERIOD` operations per
+// thread is timed.
+#ifndef LOCK_FREE_QUEUE_LATENCY_SAMPLE_PERIOD
+#define LOCK_FREE_QUEUE_LATENCY_SAMPLE_PERIOD 16
+#endif
+
+// `QueueLatency` is a snapshot of the latencies recorded by a `Queue`, in
+// `read_tsc()` ticks. Divide by `tsc_per_ns()` to get nanoseconds.
+struct QueueLatency {
+    LatencyHistogram push_back;
+    // `try_pop_front` calls that returned an element.
+    LatencyHistogram try_pop_front;
+    // `try_pop_front` calls that found the queue empty.
+    LatencyHistogram try_pop_front_empty;
+};
+
+template <bool enabled>
+class LatencyRecorder;
+
+template <>
+class LatencyRecorder<false> {
+public:
+    struct Timer {};
+
+    Timer start() { return {}; }
+    void stop_push_back(Timer) {}
+    void stop_try_pop_front(Timer, bool /*found*/) {}
+
+    QueueLatency snapshot() const { return {}; }
+};
+
+template <>
+class LatencyRecorder<true> {
+    struct Record {
+        QueueLatency latency;
+        // Number of operations to skip before timing the next one.
+        std::uint32_t countdown = 0;
+    };
+
+    PerThread<Record> records;
+
+public:
+    // If `record` is null, then the operation is not being timed.
+    struct Timer {
+        Record *record;
+        std::uint64_t started;
+    };
+
+    Timer start();
+    void stop_push_back(Timer);
+    void stop_try_pop_front(Timer, bool found);
+
+    // Return the sum of all threads' histograms.
+    QueueLatency snapshot() const;
+};
+
+inline LatencyRecorder<true>::Timer LatencyRecorder<true>::start() {
+    Record& record = records.local();
+    if (record.countdown) {
+        --record.countdown;
+        return Timer{nullptr, 0};
+    }
+    record.countdown = LOCK_FREE_QUEUE_LATENCY_SAMPLE_PERIOD - 1;
+    return Timer{&record, read_tsc()};
+}
+
+inline void LatencyRecorder<true>::stop_push_back(Timer timer) {
+    if (timer.record) {
+        timer.record->latency.push_back.record(read_tsc() - timer.started);
+    }
+}
+
+inline void LatencyRecorder<true>::stop_try_pop_front(Timer timer, bool found) {
+    if (timer.record) {
+        QueueLatency& latency = timer.record->latency;
+        (found ? latency.try_pop_front : latency.try_pop_front_empty).record(read_tsc() - timer.started);
+    }
+}
+
+inline QueueLatency LatencyRecorder<true>::snapshot() const {
+    QueueLatency total;
+    records.for_each([&](const Record& record) {
+        total.push_back.merge(record.latency.push_back);
+        total.try_pop_front.merge(record.latency.try_pop_front);
+        total.try_pop_front_empty.merge(record.latency.try_pop_front_empty);
+    });
+    return total;
+}
+
+// `CasSite` identifies each compare-and-swap retry loop in `Queue`.
+enum class CasSite {
+    // Taking a node from the free list in `push_back`.
+    free_list_pop,
+    // Advancing `before_first` in `try_pop_front`.
+    before_first,
+    // Clearing the "busy" bit of a popped node in `try_pop_front`.
+    set_busy_bit,
+    // Pointing a node being returned to the free list at the rest of the free
+    // list, in `try_pop_front`.
+    free_list_relink,
+    // Returning a node to the free list in `try_pop_front`.
+    free_list_push,
+    // Linking a new node after `last` in `push_back_node`.
+    tail_link
+};
+
+inline constexpr std::size_t n_cas_sites = std::size_t(CasSite::tail_link) + 1;
+
+inline const char *cas_site_name(CasSite site) {
+    switch (site) {
+    case CasSite::free_list_pop: return "free_list_pop";
+    case CasSite::before_first: return "before_first";
+    case CasSite::set_busy_bit: return "set_busy_bit";
+    case CasSite::free_list_relink: return "free_list_relink";
+    case CasSite::free_list_push: return "free_list_push";
+    case CasSite::tail_link: return "tail_link";
+    }
+    return "?";
+}
+
+struct CasCounters {
+    // Number of compare-and-swaps performed.
+    std::uint64_t attempts = 0;
+    // Number of compare-and-swaps that failed, and so were retried.
+    std::uint64_t failures = 0;
+    // Number of times the loop was abandoned without a successful
+    // compare-and-swap. At `free_list_pop`, this is a node found "busy."
+    std::uint64_t bails = 0;
+};
+
+// `NodeCounters` is a snapshot of how a `Queue` came by its nodes, and
+// what became of them.
+struct NodeCounters {
+    // Nodes allocated, including the initial "dummy" node. Every free list
+    // miss is followed by an allocation. `Queue` frees nodes only in its
+    // destructor, so it still owns every node it allocated.
+    std::uint64_t allocations = 0;
+    // Nodes that `push_back` took from the free list.
+    std::uint64_t free_list_hits = 0;
+    // Times `push_back` found the free list empty.
+    std::uint64_t free_list_empty = 0;
+    // Times `push_back` found the node at the front of the free list "busy,"
+    // and so allocated instead. These are the `free_list_pop` bails.
+    std::uint64_t free_list_busy = 0;
+    // Nodes that `try_pop_front` returned to the free list.
+    std::uint64_t free_list_returns = 0;
+
+    std::uint64_t free_list_misses() const {
+        return free_list_empty + free_list_busy;
+    }
+
+    // Return the number of nodes the queue owns: those in the queue (holding
+    // elements, plus the dummy) and those cached in the free list.
+    std::int64_t owned() const {
+        return std::int64_t(allocations);
+    }
+
+    // Return the number of nodes in the free list.
+    std::int64_t cached() const {
+        return std::int64_t(free_list_returns - free_list_hits);
+    }
+
+    // Return the number of nodes in the queue, including the dummy.
+    std::int64_t live() const {
+        return owned() - cached();
+    }
+};
+
+// `QueueStats` is a snapshot of the counters kept by a `Queue`, summed over
+// all threads.
+struct QueueStats {
+    CasCounters sites[n_cas_sites];
+    NodeCounters nodes;
+
+    const CasCounters& operator[](CasSite site) const {
+        return sites[std::size_t(site)];
+    }
+};
+
+// Why `push_back` didn't take a node from the free list.
+enum class FreeListMiss {
+    empty,
+    // The node at the front of the free list was "busy."
+    busy
+};
+
+template <bool enabled>
+class ContentionCounters;
+
+template <>
+class ContentionCounters<false> {
+public:
+    void attempt(CasSite, bool /*succeeded*/) {}
+    void bail(CasSite) {}
+    void allocated() {}
+    void hit() {}
+    void miss(FreeListMiss) {}
+    void returned() {}
+
+    QueueStats snapshot() const { return {}; }
+};
+
+template <>
+class ContentionCounters<true> {
+    struct Record {
+        std::atomic<std::uint64_t> attempts[n_cas_sites] = {};
+        std::atomic<std::uint64_t> failures[n_cas_sites] = {};
+        std::atomic<std::uint64_t> bails[n_cas_sites] = {};
+        // Node allocations and free list traffic.
+        std::atomic<std::uint64_t> allocations = 0;
+        std::atomic<std::uint64_t> hits = 0;
+        std::atomic<std::uint64_t> empty = 0;
+        std::atomic<std::uint64_t> busy = 0;
+        std::atomic<std::uint64_t> returns = 0;
+    };
+
+    PerThread<Record> records;
+
+public:
+    void attempt(CasSite site, bool succeeded) {
+        Record& record = records.local();
+        bump(record.attempts[std::size_t(site)]);
+        if (!succeeded) {
+            bump(record.failures[std::size_t(site)]);
+        }
+    }
+
+    void bail(CasSite site) {
+        bump(records.local().bails[std::size_t(site)]);
+    }
+
+    void allocated() { bump(records.local().allocations); }
+    void hit() { bump(records.local().hits); }
+    void miss(FreeListMiss reason) {
+        Record& record = records.local();
+        bump(reason == FreeListMiss::empty ? record.empty : record.busy);
+    }
+    void returned() { bump(records.local().returns); }
+
+    QueueStats snapshot() const;
+};
+
+inline QueueStats ContentionCounters<true>::snapshot() const {
+    QueueStats total;
+    records.for_each([&](const Record& record) {
+        for (std::size_t i = 0; i < n_cas_sites; ++i) {
+            total.sites[i].attempts += record.attempts[i].load(std::memory_order_relaxed);
+            total.sites[i].failures += record.failures[i].load(std::memory_order_relaxed);
+            total.sites[i].bails += record.bails[i].load(std::memory_order_relaxed);
+        }
+        total.nodes.allocations += record.allocations.load(std::memory_order_relaxed);
+        total.nodes.free_list_hits += record.hits.load(std::memory_order_relaxed);
+        total.nodes.free_list_empty += record.empty.load(std::memory_order_relaxed);
+        total.nodes.free_list_busy += record.busy.load(std::memory_order_relaxed);
+        total.nodes.free_list_returns += record.returns.load(std::memory_order_relaxed);
+    });
+    return total;
+}
+
+// `ThreadFairness` is what one thread did to a `Queue`, as recorded by
+// `FairnessRecorder`. Times are in `read_tsc()` ticks.
+struct ThreadFairness {
+    std::uint64_t push_successes = 0;
+    std::uint64_t pop_successes = 0;
+    // `try_pop_front` calls that found the queue empty.
+    std::uint64_t pop_empty = 0;
+    // The most compare-and-swap failures within any one operation.
+    std::uint64_t longest_retry_streak = 0;
+    // When the thread's first and last operations began.
+    std::uint64_t first_tsc = 0;
+    std::uint64_t last_tsc = 0;
+    // From the start of each successful operation to its success.
+    LatencyHistogram time_to_success;
+};
+
+// `QueueFairness` is a snapshot of every thread's `ThreadFairness`, in no
+// particular order.
+struct QueueFairness {
+    std::vector<ThreadFairness> threads;
+};
+
+// Return Jain's fairness index of `values`: (sum x)^2 / (n * sum x^2). It's 1
+// when all values are equal, and 1/n when one value has everything. Return
+// 1 if `values` is empty or all zero.
+inline double jain_index(const std::vector<double>& values) {
+    double sum = 0, sum_of_squares = 0;
+    for (const double value : values) {
+        sum += value;
+        sum_of_squares += value * value;
+    }
+    return sum_of_squares ? sum * sum / (values.size() * sum_of_squares) : 1;
+}
+
+template <bool enabled>
+class FairnessRecorder;
+
+template <>
+class FairnessRecorder<false> {
+public:
+    struct Attempt {};
+
+    Attempt begin() { return {}; }
+    void retry() {}
+    void end_push_back(Attempt) {}
+    void end_try_pop_front(Attempt, bool /*found*/) {}
+
+    QueueFairness snapshot() const { return {}; }
+};
+
+template <>
+class FairnessRecorder<true> {
+    struct Record {
+        std::atomic<std::uint64_t> push_successes = 0;
+        std::atomic<std::uint64_t> pop_successes = 0;
+        std::atomic<std::uint64_t> pop_empty = 0;
+        std::atomic<std::uint64_t> longest_retry_streak = 0;
+        std::atomic<std::uint64_t> first_tsc = 0;
+        std::atomic<std::uint64_t> last_tsc = 0;
+        LatencyHistogram time_to_success;
+        // Compare-and-swap failures so far in the current operation.
+        std::uint64_t streak = 0;
+    };
+
+    PerThread<Record> records;
+
+public:
+    struct Attempt {
+        Record *record;
+        std::uint64_t started;
+    };
+
+    Attempt begin();
+    // Note a compare-and-swap failure in the calling thread's current
+    // operation.
+    void retry();
+    void end_push_back(Attempt);
+    void end_try_pop_front(Attempt, bool found);
+
+    QueueFairness snapshot() const;
+
+private:
+    static void end(Attempt, std::atomic<std::uint64_t>& outcome, bool succeeded);
+};
+
+inline FairnessRecorder<true>::Attempt FairnessRecorder<true>::begin() {
+    Record& record = records.local();
+    const std::uint64_t now = read_tsc();
+    if (!record.first_tsc.load(std::memory_order_relaxed)) {
+        record.first_tsc.store(now, std::memory_order_relaxed);
+    }
+    record.last_tsc.store(now, std::memory_order_relaxed);
+    record.streak = 0;
+    return Attempt{&record, now};
+}
+
+inline void FairnessRecorder<true>::retry() {
+    ++records.local().streak;
+}
+
+inline void FairnessRecorder<true>::end_push_back(Attempt attempt) {
+    end(attempt, attempt.record->push_successes, true);
+}
+
+inline void FairnessRecorder<true>::end_try_pop_front(Attempt attempt, bool found) {
+    end(attempt, found ? attempt.record->pop_successes : attempt.record->pop_empty, found);
+}
+
+inline void FairnessRecorder<true>::end(Attempt attempt, std::atomic<std::uint64_t>& outcome, bool succeeded) {
+    Record& record = *attempt.record;
+    bump(outcome);
+    if (record.streak > record.longest_retry_streak.load(std::memory_order_relaxed)) {
+        record.longest_retry_streak.store(record.streak, std::memory_order_relaxed);
+    }
+    if (succeeded) {
+        record.time_to_success.record(read_tsc() - attempt.started);
+    }
+}
+
+inline QueueFairness FairnessRecorder<true>::snapshot() const {
+    QueueFairness result;
+    records.for_each([&](const Record& record) {
+        ThreadFairness thread;
+        thread.push_successes = record.push_successes.load(std::memory_order_relaxed);
+        thread.pop_successes = record.pop_successes.load(std::memory_order_relaxed);
+        thread.pop_empty = record.pop_empty.load(std::memory_order_relaxed);
+        thread.longest_retry_streak = record.longest_retry_streak.load(std::memory_order_relaxed);
+        thread.first_tsc = record.first_tsc.load(std::memory_order_relaxed);
+        thread.last_tsc = record.last_tsc.load(std::memory_order_relaxed);
+        thread.time_to_success = record.time_to_success;
+        result.threads.push_back(thread);
+    });
+    return result;
+}
+
+template <bool enabled>
+class UsdtProbes;
+
+template <>
+class UsdtProbes<false> {
+public:
+    void push_back(const void * /*queue*/, const void * /*node*/) {}
+    void try_pop_front(const void * /*queue*/, bool /*found*/) {}
+    void free_list_hit(const void * /*queue*/, const void * /*node*/) {}
+    void free_list_miss(const void * /*queue*/, FreeListMiss) {}
+    void node_alloc(const void * /*queue*/, const void * /*node*/) {}
+    void cas_retry(const void * /*queue*/, CasSite) {}
+};
+
+// Each probe's first argument is the address of the `Queue`, so that traces
+// can tell queues apart. The probes, in provider `lock_free_queue`, are:
+//
+// - `push_back(queue, node)`: an element was pushed in `node`.
+// - `try_pop_front(queue, found)`: `found` is 1 if an element was popped,
+//   and 0 if the queue was empty.
+// - `free_list_hit(queue, node)`: `push_back` reused `node`.
+// - `free_list_miss(queue, reason)`: `push_back` found no reusable node. See
+//   `FreeListMiss` for the `reason`.
+// - `node_alloc(queue, node)`: `push_back` allocated `node`.
+// - `cas_retry(queue, site)`: a compare-and-swap at `site` (a `CasSite`)
+//   failed and will be retried.
+template <>
+class UsdtProbes<true> {
+public:
+    void push_back(const void *queue, const void *node) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, push_back, queue, node);
+    }
+
+    void try_pop_front(const void *queue, bool found) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, try_pop_front, queue, found);
+    }
+
+    void free_list_hit(const void *queue, const void *node) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, free_list_hit, queue, node);
+    }
+
+    void free_list_miss(const void *queue, FreeListMiss reason) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, free_list_miss, queue, int(reason));
+    }
+
+    void node_alloc(const void *queue, const void *node) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, node_alloc, queue, node);
+    }
+
+    void cas_retry(const void *queue, CasSite site) {
+        LOCK_FREE_QUEUE_USDT_PROBE2(lock_free_queue, cas_retry, queue, int(site));
+    }
+};
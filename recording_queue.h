@@ -0,0 +1,250 @@
+#pragma once
+
+// This file contains `RecordingQueue`, a wrapper around a queue that logs
+// every `push_back` and `try_pop_front` to a binary trace, and the functions
+// for reading traces back, as `replay` does.
+//
+// Each thread that uses a `RecordingQueue` writes its own trace file,
+// "<prefix>.<n>.trace", where `n` numbers the threads in the order in which
+// they first used the queue. A trace file is:
+//
+//     "LFQTRACE"    8 bytes of magic
+//     version       1 byte, currently 1
+//     events...
+//
+// and each event is:
+//
+//     delta_ns      varint: nanoseconds since the thread's previous event, or
+//                   since the `RecordingQueue` was constructed
+//     op            1 byte: a `TraceOp`
+//     size          varint: the payload size of the pushed or popped element;
+//                   omitted for `TraceOp::pop_empty`
+//
+// where a varint is an unsigned integer in little-endian groups of seven
+// bits, with the high bit of each byte set if another byte follows. Since
+// every thread's times are measured from the same moment, the traces can be
+// replayed together with their original timing and concurrency.
+//
+// An element's payload size is `payload_size(element)`, which is the string's
+// size for strings and `sizeof` otherwise. Overload it for other types.
+
+#include "lock_free_queue.h"
+#include "per_thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class TraceOp : std::uint8_t {
+    push,
+    pop,
+    // `try_pop_front` found the queue empty.
+    pop_empty
+};
+
+struct TraceEvent {
+    // Nanoseconds since recording began.
+    std::uint64_t ns;
+    TraceOp op;
+    std::uint32_t size;
+};
+
+template <typename T>
+std::uint32_t payload_size(const T&) {
+    return sizeof(T);
+}
+
+inline std::uint32_t payload_size(const std::string& value) {
+    return std::uint32_t(value.size());
+}
+
+inline constexpr char trace_magic[8] = {'L', 'F', 'Q', 'T', 'R', 'A', 'C', 'E'};
+inline constexpr std::uint8_t trace_version = 1;
+
+// `RecordingQueue<T, Q>` has the same interface as `Q<T>`, and records each
+// operation before forwarding it to its `Q<T>`. Recording costs a clock read
+// and a few bytes of buffer per operation. Each thread's buffer is written
+// to its file whenever it fills, and when the `RecordingQueue` is destroyed,
+// which must happen after all threads are done with it.
+//
+// If a thread's trace file can't be opened, then that thread's first
+// operation throws `std::runtime_error` without touching the queue.
+template <typename T, template <typename> class Q = Queue>
+class RecordingQueue {
+    struct Stream {
+        std::FILE *file = nullptr;
+        std::vector<unsigned char> buffer;
+        std::uint64_t previous_ns = 0;
+    };
+
+    Q<T> queue;
+    const std::string prefix;
+    const std::chrono::steady_clock::time_point started;
+    std::atomic<int> n_streams;
+    PerThread<Stream> streams;
+
+    static constexpr std::size_t flush_threshold = 1 << 20;
+
+public:
+    template <typename... Args>
+    explicit RecordingQueue(std::string prefix, Args&&... queue_args);
+    ~RecordingQueue();
+
+    template <typename Value>
+    void push_back(Value&& value);
+    std::optional<T> try_pop_front();
+
+    // Return the number of trace files written so far.
+    int trace_count() const;
+
+private:
+    Stream& stream();
+    static void record(Stream& out, TraceOp op, std::uint32_t size, std::uint64_t ns);
+    std::uint64_t now_ns() const;
+    static void flush(Stream& stream);
+};
+
+template <typename T, template <typename> class Q>
+template <typename... Args>
+RecordingQueue<T, Q>::RecordingQueue(std::string prefix, Args&&... queue_args)
+: queue(std::forward<Args>(queue_args)...)
+, prefix(std::move(prefix))
+, started(std::chrono::steady_clock::now())
+, n_streams(0) {}
+
+template <typename T, template <typename> class Q>
+RecordingQueue<T, Q>::~RecordingQueue() {
+    streams.for_each([](Stream& stream) {
+        if (stream.file) {
+            flush(stream);
+            std::fclose(stream.file);
+        }
+    });
+}
+
+template <typename T, template <typename> class Q>
+template <typename Value>
+void RecordingQueue<T, Q>::push_back(Value&& value) {
+    Stream& out = stream();
+    const std::uint64_t ns = now_ns();
+    const std::uint32_t size = payload_size(value);
+    queue.push_back(std::forward<Value>(value));
+    record(out, TraceOp::push, size, ns);
+}
+
+template <typename T, template <typename> class Q>
+std::optional<T> RecordingQueue<T, Q>::try_pop_front() {
+    Stream& out = stream();
+    const std::uint64_t ns = now_ns();
+    std::optional<T> result = queue.try_pop_front();
+    record(out, result ? TraceOp::pop : TraceOp::pop_empty, result ? payload_size(*result) : 0, ns);
+    return result;
+}
+
+template <typename T, template <typename> class Q>
+int RecordingQueue<T, Q>::trace_count() const {
+    return n_streams.load();
+}
+
+template <typename T, template <typename> class Q>
+typename RecordingQueue<T, Q>::Stream& RecordingQueue<T, Q>::stream() {
+    Stream& stream = streams.local();
+    if (!stream.file) {
+        const std::string path = prefix + "." + std::to_string(n_streams.fetch_add(1)) + ".trace";
+        stream.file = std::fopen(path.c_str(), "wb");
+        if (!stream.file) {
+            throw std::runtime_error("unable to open trace file " + path);
+        }
+        stream.buffer.reserve(flush_threshold + 16);
+        stream.buffer.insert(stream.buffer.end(), std::begin(trace_magic), std::end(trace_magic));
+        stream.buffer.push_back(trace_version);
+    }
+    return stream;
+}
+
+template <typename T, template <typename> class Q>
+void RecordingQueue<T, Q>::record(Stream& out, TraceOp op, std::uint32_t size, std::uint64_t ns) {
+    const auto varint = [&](std::uint64_t value) {
+        while (value >= 0x80) {
+            out.buffer.push_back((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out.buffer.push_back(value);
+    };
+    varint(ns - out.previous_ns);
+    out.previous_ns = ns;
+    out.buffer.push_back(std::uint8_t(op));
+    if (op != TraceOp::pop_empty) {
+        varint(size);
+    }
+    if (out.buffer.size() >= flush_threshold) {
+        flush(out);
+    }
+}
+
+template <typename T, template <typename> class Q>
+std::uint64_t RecordingQueue<T, Q>::now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+template <typename T, template <typename> class Q>
+void RecordingQueue<T, Q>::flush(Stream& stream) {
+    std::fwrite(stream.buffer.data(), 1, stream.buffer.size(), stream.file);
+    stream.buffer.clear();
+}
+
+// Read the trace file at `path`. Throw `std::runtime_error` if it can't be
+// read or is malformed.
+inline std::vector<TraceEvent> read_trace(const std::string& path) {
+    const auto fail = [&](const char *why) {
+        throw std::runtime_error("trace file " + path + ": " + why);
+    };
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        fail("unable to open");
+    }
+    const std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    if (bytes.size() < sizeof trace_magic + 1 || !std::equal(std::begin(trace_magic), std::end(trace_magic), bytes.begin())) {
+        fail("not a trace file");
+    }
+    if (bytes[sizeof trace_magic] != trace_version) {
+        fail("unsupported version");
+    }
+
+    std::size_t i = sizeof trace_magic + 1;
+    const auto varint = [&]() {
+        std::uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (i == bytes.size() || shift > 63) {
+                fail("truncated or malformed varint");
+            }
+            const unsigned char byte = bytes[i++];
+            value |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+    };
+
+    std::vector<TraceEvent> events;
+    std::uint64_t ns = 0;
+    while (i < bytes.size()) {
+        ns += varint();
+        if (i == bytes.size() || bytes[i] > std::uint8_t(TraceOp::pop_empty)) {
+            fail("truncated or unknown operation");
+        }
+        const TraceOp op = TraceOp(bytes[i++]);
+        const std::uint32_t size = op == TraceOp::pop_empty ? 0 : std::uint32_t(varint());
+        events.push_back(TraceEvent{ns, op, size});
+    }
+    return events;
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+// This file contains simpler queues against which `Queue` is benchmarked.
+// Each has the same interface as `Queue`:
+//
+//     template <typename Value>
+//     void push_back(Value&& value);
+//     std::optional<T> try_pop_front();
+//
+// - `MutexDequeQueue<T>` is a `std::deque` guarded by a `std::mutex`.
+// - `SpinlockQueue<T>` is a `std::deque` guarded by a spinlock.
+// - `TwoLockQueue<T>` is the two-lock queue from Michael & Scott, "Simple,
+//   Fast, and Practical Non-Blocking and Blocking Concurrent Queue
+//   Algorithms," 1996. Producers and consumers take different locks.
+// - `BoundedRingQueue<T>` is a fixed-capacity ring buffer in which each slot
+//   carries a sequence number (Dmitry Vyukov's bounded MPMC queue).
+//   `push_back` spins while the ring is full.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+template <typename T>
+class MutexDequeQueue {
+    std::mutex mutex;
+    std::deque<T> elements;
+
+public:
+    template <typename Value>
+    void push_back(Value&& value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        elements.emplace_back(std::forward<Value>(value));
+    }
+
+    std::optional<T> try_pop_front() {
+        std::optional<T> result;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!elements.empty()) {
+            result = std::move(elements.front());
+            elements.pop_front();
+        }
+        return result;
+    }
+};
+
+// `Spinlock` is a test-and-test-and-set lock that yields while contended.
+class Spinlock {
+    std::atomic<bool> locked = false;
+
+public:
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            while (locked.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+template <typename T>
+class SpinlockQueue {
+    Spinlock spinlock;
+    std::deque<T> elements;
+
+public:
+    template <typename Value>
+    void push_back(Value&& value) {
+        std::lock_guard<Spinlock> lock(spinlock);
+        elements.emplace_back(std::forward<Value>(value));
+    }
+
+    std::optional<T> try_pop_front() {
+        std::optional<T> result;
+        std::lock_guard<Spinlock> lock(spinlock);
+        if (!elements.empty()) {
+            result = std::move(elements.front());
+            elements.pop_front();
+        }
+        return result;
+    }
+};
+
+template <typename T>
+class TwoLockQueue {
+    struct Node {
+        std::optional<T> value;
+        // `next` is written under `tail_mutex` and read under `head_mutex`,
+        // so it must be atomic.
+        std::atomic<Node*> next = nullptr;
+    };
+
+    // Keep the consumers' and producers' halves on separate cache lines.
+    alignas(64) std::mutex head_mutex;
+    Node *head; // "dummy" node, as in `Queue`
+    alignas(64) std::mutex tail_mutex;
+    Node *tail;
+
+public:
+    TwoLockQueue()
+    : head(new Node)
+    , tail(head) {}
+
+    ~TwoLockQueue() {
+        Node *next;
+        for (Node *node = head; node; node = next) {
+            next = node->next.load(std::memory_order_relaxed);
+            delete node;
+        }
+    }
+
+    template <typename Value>
+    void push_back(Value&& value) {
+        Node *node = new Node;
+        node->value.emplace(std::forward<Value>(value));
+        std::lock_guard<std::mutex> lock(tail_mutex);
+        tail->next.store(node, std::memory_order_release);
+        tail = node;
+    }
+
+    std::optional<T> try_pop_front() {
+        std::optional<T> result;
+        Node *old_head;
+        {
+            std::lock_guard<std::mutex> lock(head_mutex);
+            Node *new_head = head->next.load(std::memory_order_acquire);
+            if (!new_head) {
+                return result;
+            }
+            result = std::move(new_head->value);
+            new_head->value.reset();
+            old_head = head;
+            head = new_head;
+        }
+        delete old_head;
+        return result;
+    }
+};
+
+template <typename T>
+class BoundedRingQueue {
+    struct Slot {
+        // If `sequence` equals the position being pushed, then the slot is
+        // free for that push. If it equals the position being popped plus
+        // one, then the slot holds the value for that pop.
+        std::atomic<std::size_t> sequence;
+        union {
+            T value;
+        };
+
+        Slot() {}
+        ~Slot() {}
+    };
+
+    const std::size_t mask;
+    const std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<std::size_t> push_position = 0;
+    alignas(64) std::atomic<std::size_t> pop_position = 0;
+
+public:
+    // Create a ring that holds at least `capacity` elements.
+    explicit BoundedRingQueue(std::size_t capacity);
+    ~BoundedRingQueue();
+
+    template <typename Value>
+    void push_back(Value&& value);
+    // Push `value` unless the ring is full. Return whether `value` was
+    // pushed.
+    template <typename Value>
+    bool try_push_back(Value&& value);
+    std::optional<T> try_pop_front();
+
+private:
+    static std::size_t round_up(std::size_t capacity);
+};
+
+template <typename T>
+BoundedRingQueue<T>::BoundedRingQueue(std::size_t capacity)
+: mask(round_up(capacity) - 1)
+, slots(new Slot[mask + 1]) {
+    for (std::size_t i = 0; i <= mask; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+BoundedRingQueue<T>::~BoundedRingQueue() {
+    while (try_pop_front()) {}
+}
+
+template <typename T>
+template <typename Value>
+void BoundedRingQueue<T>::push_back(Value&& value) {
+    // `try_push_back` forwards `value` only if it succeeds.
+    while (!try_push_back(std::forward<Value>(value))) {
+        std::this_thread::yield();
+    }
+}
+
+template <typename T>
+template <typename Value>
+bool BoundedRingQueue<T>::try_push_back(Value&& value) {
+    std::size_t position = push_position.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = slots[position & mask];
+        const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const std::intptr_t difference = std::intptr_t(sequence) - std::intptr_t(position);
+        if (difference == 0) {
+            if (push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                new (&slot.value) T(std::forward<Value>(value));
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false; // full
+        } else {
+            position = push_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+std::optional<T> BoundedRingQueue<T>::try_pop_front() {
+    std::optional<T> result;
+    std::size_t position = pop_position.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = slots[position & mask];
+        const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const std::intptr_t difference = std::intptr_t(sequence) - std::intptr_t(position + 1);
+        if (difference == 0) {
+            if (pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                result = std::move(slot.value);
+                slot.value.~T();
+                slot.sequence.store(position + mask + 1, std::memory_order_release);
+                return result;
+            }
+        } else if (difference < 0) {
+            return result; // empty
+        } else {
+            position = pop_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+std::size_t BoundedRingQueue<T>::round_up(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    return size;
+}
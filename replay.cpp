@@ -0,0 +1,209 @@
+// This program replays traces written by `RecordingQueue` against each queue
+// engine, so that engines can be compared on recorded traffic rather than
+// on synthetic workloads.
+//
+// Each trace file is replayed by its own thread, reproducing the recorded
+// concurrency. Each operation is issued at its recorded time (scaled by
+// `--speed`), measured from when replay began, regardless of how long
+// earlier operations took, as in `open_loop`. Pushes push a string of the
+// recorded payload size. Pops pop once, whether or not the recorded pop
+// found an element.
+//
+// For each engine, the program reports the throughput achieved, the
+// percentiles of operation service time, how late operations were issued,
+// and how many pops found the queue empty when the recorded pop didn't, or
+// vice versa.
+
+#include "bench.h"
+#include "latency.h"
+#include "recording_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ReplayConfig {
+    std::vector<std::string> paths;
+    // Replay this many times faster than recorded. Zero means issue every
+    // operation as soon as the previous one returns.
+    double speed = 1;
+    // Name of the engine to replay against, or "all".
+    std::string engine = "all";
+};
+
+ReplayConfig parse_args(int argc, char *argv[]) {
+    ReplayConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--speed FACTOR] [--engine NAME | --engine all] TRACE_FILE...\n";
+        std::exit(2);
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            config.speed = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--engine" && i + 1 < argc) {
+            config.engine = argv[++i];
+        } else if (arg.rfind("--", 0) == 0) {
+            usage();
+        } else {
+            config.paths.push_back(arg);
+        }
+    }
+    if (!selects_engine(config.engine)) {
+        std::cerr << "unknown engine: " << config.engine << '\n';
+        usage();
+    }
+    if (config.paths.empty()) {
+        usage();
+    }
+    return config;
+}
+
+struct ReplayResult {
+    double seconds = 0;
+    std::uint64_t operations = 0;
+    // Nanoseconds spent in each `push_back` or `try_pop_front`.
+    LatencyHistogram service;
+    // Nanoseconds by which each operation was issued after its scheduled
+    // time.
+    LatencyHistogram lateness;
+    // Pops whose outcome (element or empty) differed from the recording.
+    std::uint64_t mismatched_pops = 0;
+};
+
+// Return an upper bound on how deep the recorded queue got, by merging all
+// threads' events in time order. Events at nearly the same time in different
+// threads might really have happened in either order, so this is approximate.
+std::size_t recorded_depth(const std::vector<std::vector<TraceEvent>>& traces) {
+    std::vector<TraceEvent> all;
+    for (const std::vector<TraceEvent>& trace : traces) {
+        all.insert(all.end(), trace.begin(), trace.end());
+    }
+    std::stable_sort(all.begin(), all.end(), [](const TraceEvent& left, const TraceEvent& right) {
+        return left.ns < right.ns;
+    });
+    std::int64_t depth = 0, deepest = 0;
+    for (const TraceEvent& event : all) {
+        depth += event.op == TraceOp::push ? 1 : event.op == TraceOp::pop ? -1 : 0;
+        deepest = std::max(deepest, depth);
+    }
+    return std::size_t(deepest);
+}
+
+template <template <typename> class Q>
+ReplayResult replay(const std::vector<std::vector<TraceEvent>>& traces, const ReplayConfig& config) {
+    using Clock = std::chrono::steady_clock;
+    // A bounded engine needs room for the deepest the queue got, or else a
+    // push could wait forever on pops that were scheduled after it.
+    const auto queue = EngineTraits<Q>::template make<std::string>(2 * recorded_depth(traces) + 1024);
+    const int n_threads = int(traces.size());
+    std::vector<ReplayResult> results(n_threads);
+    std::atomic<std::int64_t> start_ns(0);
+
+    const double seconds = run_threads(n_threads, [&](int i) {
+        const auto now_ns = []() -> std::int64_t {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+        };
+        if (i == 0) {
+            start_ns.store(now_ns() + 1'000'000); // start in a millisecond
+        }
+        std::int64_t start;
+        while ((start = start_ns.load()) == 0) {}
+
+        ReplayResult& result = results[i];
+        for (const TraceEvent& event : traces[i]) {
+            std::int64_t now = now_ns();
+            if (config.speed > 0) {
+                const std::int64_t scheduled = start + std::int64_t(event.ns / config.speed);
+                while ((now = now_ns()) < scheduled) {
+                    if (scheduled - now > 50'000) {
+                        std::this_thread::yield();
+                    }
+                }
+                result.lateness.record(std::uint64_t(now - scheduled));
+            }
+
+            if (event.op == TraceOp::push) {
+                std::string payload(event.size, 'x');
+                now = now_ns();
+                queue->push_back(std::move(payload));
+            } else {
+                now = now_ns();
+                const bool found = queue->try_pop_front().has_value();
+                result.mismatched_pops += found != (event.op == TraceOp::pop);
+            }
+            result.service.record(std::uint64_t(now_ns() - now));
+            ++result.operations;
+        }
+    });
+
+    ReplayResult total;
+    total.seconds = seconds;
+    for (const ReplayResult& result : results) {
+        total.operations += result.operations;
+        total.service.merge(result.service);
+        total.lateness.merge(result.lateness);
+        total.mismatched_pops += result.mismatched_pops;
+    }
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    const ReplayConfig config = parse_args(argc, argv);
+    std::vector<std::vector<TraceEvent>> traces;
+    std::size_t n_events = 0;
+    try {
+        for (const std::string& path : config.paths) {
+            traces.push_back(read_trace(path));
+            n_events += traces.back().size();
+        }
+    } catch (const std::runtime_error& error) {
+        std::cerr << error.what() << '\n';
+        return 1;
+    }
+
+    std::uint64_t last_ns = 0;
+    for (const std::vector<TraceEvent>& trace : traces) {
+        if (!trace.empty()) {
+            last_ns = std::max(last_ns, trace.back().ns);
+        }
+    }
+    std::cout << traces.size() << " thread(s), " << n_events << " operations over "
+              << last_ns / 1e9 << "s recorded, replayed at ";
+    if (config.speed > 0) {
+        std::cout << config.speed << "x\n";
+    } else {
+        std::cout << "full speed\n";
+    }
+    std::cout << std::left << std::setw(20) << "engine" << std::right
+              << std::setw(12) << "seconds" << std::setw(12) << "Mop/s"
+              << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::setw(12) << "p99.9 ns"
+              << std::setw(14) << "late p99 us" << std::setw(12) << "mismatched" << '\n';
+
+    for_each_engine([&]<template <typename> class Q>() {
+        if (config.engine != "all" && config.engine != EngineTraits<Q>::name) {
+            return;
+        }
+        const ReplayResult result = replay<Q>(traces, config);
+        std::cout << std::left << std::setw(20) << EngineTraits<Q>::name << std::right
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(12) << result.seconds
+                  << std::setw(12) << result.operations / result.seconds / 1e6
+                  << std::setw(10) << result.service.value_at(0.50)
+                  << std::setw(10) << result.service.value_at(0.99)
+                  << std::setw(12) << result.service.value_at(0.999)
+                  << std::setprecision(1)
+                  << std::setw(14) << result.lateness.value_at(0.99) / 1e3
+                  << std::setw(12) << result.mismatched_pops
+                  << std::defaultfloat << std::setprecision(6) << '\n';
+    });
+}
@@ -0,0 +1,190 @@
+// This program measures how long it takes for an element pushed into an
+// empty `Queue` to reach a consumer that is waiting for it, for each way a
+// consumer can wait:
+//
+// - coroutine (inline): a coroutine suspended in `co_await queue.pop()`,
+//   which `push_back` resumes on the pushing thread.
+// - coroutine (executor): the same, but `push_back` hands the coroutine to
+//   an executor thread that is spinning on a run queue.
+// - spin: a thread calling `try_pop_front` in a loop.
+// - park: a thread sleeping on a futex (see `EventCount`) until the
+//   producer notifies it.
+//
+// Each element carries the time it was pushed, and the consumer records the
+// difference when it receives the element. The producer waits for each
+// element to be received, and then for the consumer to be waiting again,
+// before pushing the next, so that every sample measures a wakeup.
+
+#include "futex.h"
+#include "latency.h"
+#include "lock_free_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+
+struct ResumeConfig {
+    long samples = 100'000;
+};
+
+ResumeConfig parse_args(int argc, char *argv[]) {
+    ResumeConfig config;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--samples" && i + 1 < argc) {
+            config.samples = std::max(1L, std::atol(argv[++i]));
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--samples N]\n";
+            std::exit(2);
+        }
+    }
+    return config;
+}
+
+void print_histogram(const char *name, const LatencyHistogram& histogram) {
+    const double ticks_per_ns = tsc_per_ns();
+    const auto ns = [&](std::uint64_t ticks) { return ticks / ticks_per_ns; };
+    std::cout << std::left << std::setw(22) << name << std::right
+              << std::fixed << std::setprecision(0)
+              << std::setw(10) << ns(histogram.value_at(0.50))
+              << std::setw(10) << ns(histogram.value_at(0.99))
+              << std::setw(10) << ns(histogram.value_at(0.999))
+              << std::setw(12) << ns(histogram.max())
+              << std::defaultfloat << std::setprecision(6) << '\n';
+}
+
+// Wait, politely, until `predicate()`.
+template <typename Predicate>
+void await(Predicate&& predicate) {
+    while (!predicate()) {
+        std::this_thread::yield();
+    }
+}
+
+// `SpinningExecutor` runs scheduled coroutines on a thread of its own.
+class SpinningExecutor {
+    Queue<std::coroutine_handle<>> ready;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+public:
+    SpinningExecutor()
+    : stopping(false)
+    , thread([this]() {
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (const std::optional<std::coroutine_handle<>> handle = ready.try_pop_front()) {
+                handle->resume();
+            }
+        }
+    }) {}
+
+    ~SpinningExecutor() {
+        stopping.store(true);
+        thread.join();
+    }
+
+    void schedule(std::coroutine_handle<> handle) {
+        ready.push_back(handle);
+    }
+};
+
+// Receive `samples` elements from `queue`, recording into `histogram` how
+// long each took to arrive, and counting them in `received`. Set `done` once
+// there is nothing left to do but return.
+template <typename Executor>
+Detached receive(Queue<std::uint64_t>& queue, long samples, LatencyHistogram& histogram,
+                 std::atomic<long>& received, std::atomic<bool>& done, Executor *executor) {
+    for (long i = 0; i < samples; ++i) {
+        std::uint64_t pushed;
+        if (executor) {
+            pushed = co_await queue.pop(*executor);
+        } else {
+            pushed = co_await queue.pop();
+        }
+        histogram.record(read_tsc() - pushed);
+        received.store(i + 1);
+    }
+    done.store(true);
+}
+
+// Measure a coroutine consumer, resumed by `push_back` if `executor` is null,
+// or by `executor` otherwise.
+template <typename Executor>
+LatencyHistogram measure_coroutine(const ResumeConfig& config, Executor *executor) {
+    Queue<std::uint64_t> queue;
+    LatencyHistogram histogram;
+    std::atomic<long> received(0);
+    std::atomic<bool> done(false);
+    receive(queue, config.samples, histogram, received, done, executor);
+    for (long i = 0; i < config.samples; ++i) {
+        queue.push_back(read_tsc());
+        await([&]() { return received.load() > i; });
+    }
+    // The coroutine might still be running on the executor's thread.
+    await([&]() { return done.load(); });
+    return histogram;
+}
+
+LatencyHistogram measure_thread(const ResumeConfig& config, bool park) {
+    Queue<std::uint64_t> queue;
+    EventCount events;
+    LatencyHistogram histogram;
+    std::atomic<long> received(0);
+    // Whether the consumer is about to wait or is waiting.
+    std::atomic<bool> waiting(false);
+
+    std::thread consumer([&]() {
+        for (long i = 0; i < config.samples; ++i) {
+            waiting.store(true);
+            std::optional<std::uint64_t> pushed;
+            while (!(pushed = queue.try_pop_front())) {
+                if (!park) {
+                    continue;
+                }
+                const EventCount::Key key = events.prepare_wait();
+                if ((pushed = queue.try_pop_front())) {
+                    events.cancel_wait();
+                    break;
+                }
+                events.wait(key);
+            }
+            histogram.record(read_tsc() - *pushed);
+            waiting.store(false);
+            received.store(i + 1);
+        }
+    });
+
+    for (long i = 0; i < config.samples; ++i) {
+        await([&]() { return waiting.load() && (!park || events.has_waiters()); });
+        queue.push_back(read_tsc());
+        events.notify_one();
+        await([&]() { return received.load() > i; });
+    }
+    consumer.join();
+    return histogram;
+}
+
+int main(int argc, char *argv[]) {
+    const ResumeConfig config = parse_args(argc, argv);
+    std::cout << "TSC ticks per ns: " << tsc_per_ns() << '\n'
+              << config.samples << " samples, push to receipt, in ns\n"
+              << std::left << std::setw(22) << "consumer" << std::right
+              << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p99.9"
+              << std::setw(12) << "max" << '\n';
+
+    SpinningExecutor *const inline_resume = nullptr;
+    print_histogram("coroutine (inline)", measure_coroutine(config, inline_resume));
+    {
+        SpinningExecutor executor;
+        print_histogram("coroutine (executor)", measure_coroutine(config, &executor));
+    }
+    print_histogram("spin", measure_thread(config, false));
+    print_histogram("park", measure_thread(config, true));
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+// This file contains `Selector`, which lets one consumer thread wait for any
+// of several queues to have an element, sleeping on a single futex, and then
+// tells it which queue to pop from.
+//
+// Each queue gets a `Notifier` whose `fire()` bumps the selector's futex
+// word and wakes the sleeper. While the consumer is busy, its notifiers are
+// disarmed, so producers pay only the load that `Notifier::notify` costs.
+
+#include "futex.h"
+#include "notifier.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// `Selector<SomeQueue>` watches a fixed set of queues, each of which must
+// have `empty()` and `set_notifier(Notifier*)`, as `Queue` does. A selector
+// takes over its queues' notifier slots, so a queue can be watched by only
+// one selector (or other notifier) at a time, and it must outlive the
+// selector. Only one thread at a time may select.
+//
+//     Selector<Queue<Message>> selector({&control, &data, &bulk}, {4, 2, 1});
+//     for (;;) {
+//         const std::size_t i = selector.select();
+//         // Pop from the queue at index `i`, which has an element unless
+//         // another consumer got to it first.
+//     }
+//
+// Ready queues are chosen by weighted round robin: the queue at index `i`
+// is chosen at most `weights[i]` times in a row while it stays ready, and
+// then the ready queue after it, cyclically, gets a turn. So no ready queue
+// waits for more than the sum of the other queues' weights. With all weights
+// one (the default), this is plain round robin. Larger weights give a queue
+// a larger share when several are busy.
+template <typename SomeQueue>
+class Selector {
+    // `Wakeup` is the notifier installed in each queue.
+    class Wakeup : public Notifier {
+        std::atomic<std::uint32_t>& epoch;
+
+    public:
+        explicit Wakeup(std::atomic<std::uint32_t>& epoch)
+        : epoch(epoch) {}
+
+    protected:
+        void fire() override {
+            epoch.fetch_add(1);
+            futex_wake(epoch, 1);
+        }
+    };
+
+    // Incremented whenever an armed queue gets an element. The consumer
+    // sleeps on this.
+    std::atomic<std::uint32_t> epoch;
+    const std::vector<SomeQueue*> queues;
+    const std::vector<unsigned> weights;
+    std::vector<std::unique_ptr<Wakeup>> wakeups;
+    // The queue chosen last, and how many more times in a row it may be
+    // chosen.
+    std::size_t current;
+    unsigned credit;
+
+public:
+    // Watch `queues`, which must not be empty. `weights`, if not empty, has
+    // a positive weight for each queue.
+    explicit Selector(std::vector<SomeQueue*> queues, std::vector<unsigned> weights = {});
+    ~Selector();
+
+    Selector(const Selector&) = delete;
+    Selector& operator=(const Selector&) = delete;
+
+    std::size_t size() const;
+
+    // Return the index of a queue that has an element, or null if none does.
+    std::optional<std::size_t> try_select();
+
+    // Return the index of a queue that has an element, sleeping until one
+    // does.
+    std::size_t select();
+
+    // Like `select`, but give up after `timeout`, returning null.
+    template <typename Rep, typename Period>
+    std::optional<std::size_t> select_for(const std::chrono::duration<Rep, Period>& timeout);
+
+private:
+    // Sleep until a queue might have an element, but not past `deadline` if
+    // there is one.
+    void wait(std::optional<std::chrono::steady_clock::time_point> deadline);
+};
+
+template <typename SomeQueue>
+Selector<SomeQueue>::Selector(std::vector<SomeQueue*> queues, std::vector<unsigned> weights)
+: epoch(0)
+, queues(std::move(queues))
+, weights(weights.empty() ? std::vector<unsigned>(this->queues.size(), 1) : std::move(weights))
+// Start just before the first queue, so that it's chosen first.
+, current(this->queues.size() - 1)
+, credit(0) {
+    assert(!this->queues.empty());
+    assert(this->weights.size() == this->queues.size());
+    assert(std::find(this->weights.begin(), this->weights.end(), 0u) == this->weights.end());
+    for (SomeQueue *queue : this->queues) {
+        wakeups.push_back(std::make_unique<Wakeup>(epoch));
+        queue->set_notifier(wakeups.back().get());
+    }
+}
+
+template <typename SomeQueue>
+Selector<SomeQueue>::~Selector() {
+    for (SomeQueue *queue : queues) {
+        queue->set_notifier(nullptr);
+    }
+}
+
+template <typename SomeQueue>
+std::size_t Selector<SomeQueue>::size() const {
+    return queues.size();
+}
+
+template <typename SomeQueue>
+std::optional<std::size_t> Selector<SomeQueue>::try_select() {
+    if (credit && !queues[current]->empty()) {
+        --credit;
+        return current;
+    }
+    for (std::size_t i = 1; i <= queues.size(); ++i) {
+        const std::size_t candidate = (current + i) % queues.size();
+        if (!queues[candidate]->empty()) {
+            current = candidate;
+            credit = weights[candidate] - 1;
+            return candidate;
+        }
+    }
+    return std::nullopt;
+}
+
+template <typename SomeQueue>
+std::size_t Selector<SomeQueue>::select() {
+    for (;;) {
+        if (const std::optional<std::size_t> ready = try_select()) {
+            return *ready;
+        }
+        wait(std::nullopt);
+    }
+}
+
+template <typename SomeQueue>
+template <typename Rep, typename Period>
+std::optional<std::size_t> Selector<SomeQueue>::select_for(const std::chrono::duration<Rep, Period>& timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+        if (const std::optional<std::size_t> ready = try_select()) {
+            return ready;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return std::nullopt;
+        }
+        wait(std::chrono::time_point_cast<std::chrono::steady_clock::duration>(deadline));
+    }
+}
+
+template <typename SomeQueue>
+void Selector<SomeQueue>::wait(std::optional<std::chrono::steady_clock::time_point> deadline) {
+    // Read the epoch before arming, so that a push after arming changes it,
+    // and the futex doesn't sleep.
+    const std::uint32_t key = epoch.load();
+    bool armed = true;
+    for (std::size_t i = 0; armed && i < queues.size(); ++i) {
+        armed = wakeups[i]->arm(*queues[i]);
+    }
+    if (armed) {
+        std::chrono::nanoseconds timeout(-1);
+        if (deadline) {
+            timeout = std::max(std::chrono::nanoseconds(0), std::chrono::duration_cast<std::chrono::nanoseconds>(
+                *deadline - std::chrono::steady_clock::now()));
+        }
+        futex_wait(epoch, key, timeout);
+    }
+    // Whichever queue fired has disarmed itself. Disarm the rest, so that
+    // producers don't wake a consumer that isn't asleep.
+    for (const std::unique_ptr<Wakeup>& wakeup : wakeups) {
+        wakeup->disarm();
+    }
+}
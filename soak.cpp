@@ -0,0 +1,226 @@
+// This program is a long-running soak test of `Queue`'s memory behavior.
+// It must be compiled with `LOCK_FREE_QUEUE_STATS` defined, because it
+// takes its node counts from `Queue::stats()`.
+//
+// Producers push in bursts of random size, separated by idle periods, while
+// consumers pop continuously, so the queue repeatedly grows and drains.
+// Elements are strings of random length, some short enough for the small
+// string optimization and some not.
+//
+// Every sampling interval, the program prints the process's resident set
+// size, the queue's depth, the free list's length, the number of nodes the
+// queue owns, and the number of heap allocations made and still live.
+//
+// `Queue` never frees nodes until it's destroyed, so the node count tracks
+// the deepest the queue has ever been. That is fine as long as it levels
+// off. At the end, the program compares the second half of the run with the
+// first (after a warm-up period). If the peak RSS or node count grew by more
+// than `--tolerance` percent, it reports possible unbounded growth and exits
+// with status 1.
+
+#include "lock_free_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static_assert(queue_stats_enabled, "compile with -DLOCK_FREE_QUEUE_STATS");
+
+// Count heap allocations made by the whole program.
+std::atomic<std::uint64_t> n_allocations(0);
+std::atomic<std::uint64_t> n_deallocations(0);
+
+void *operator new(std::size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    if (memory) {
+        n_deallocations.fetch_add(1, std::memory_order_relaxed);
+        std::free(memory);
+    }
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    operator delete(memory);
+}
+
+struct SoakConfig {
+    double seconds = 60;
+    double interval_seconds = 1;
+    // Fraction of the run, at the start, that is excluded from the growth
+    // check.
+    double warm_up = 0.2;
+    double tolerance_percent = 5;
+    int producers = 2;
+    int consumers = 2;
+    // Each burst pushes up to this many elements per producer.
+    long max_burst = 100'000;
+};
+
+SoakConfig parse_args(int argc, char *argv[]) {
+    SoakConfig config;
+    const auto usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--duration SECONDS] [--interval SECONDS] [--tolerance PERCENT]"
+                     " [--producers N] [--consumers N] [--max-burst N]\n";
+        std::exit(2);
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        if (arg == "--duration") {
+            config.seconds = std::atof(argv[++i]);
+        } else if (arg == "--interval") {
+            config.interval_seconds = std::atof(argv[++i]);
+        } else if (arg == "--tolerance") {
+            config.tolerance_percent = std::atof(argv[++i]);
+        } else if (arg == "--producers") {
+            config.producers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--consumers") {
+            config.consumers = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--max-burst") {
+            config.max_burst = std::max(1L, std::atol(argv[++i]));
+        } else {
+            usage();
+        }
+    }
+    return config;
+}
+
+// Return the resident set size of this process, in bytes.
+std::uint64_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct Sample {
+    double seconds;
+    std::uint64_t rss;
+    std::int64_t depth;
+    std::int64_t free_list;
+    std::int64_t nodes;
+    std::uint64_t allocations;
+    std::int64_t live_allocations;
+};
+
+// Return the peak `field` over samples taken in `[begin, end)` seconds.
+template <typename Field>
+double peak(const std::vector<Sample>& samples, double begin, double end, Field field) {
+    double result = 0;
+    for (const Sample& sample : samples) {
+        if (sample.seconds >= begin && sample.seconds < end) {
+            result = std::max(result, double(sample.*field));
+        }
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const SoakConfig config = parse_args(argc, argv);
+
+    Queue<std::string> queue;
+    std::atomic<bool> stop(false);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.producers; ++i) {
+        threads.emplace_back([&, i]() {
+            std::mt19937_64 random(i);
+            std::uniform_int_distribution<long> burst_size(1, config.max_burst);
+            std::uniform_int_distribution<int> idle_ms(1, 200);
+            std::uniform_int_distribution<std::size_t> length(0, 64);
+            while (!stop.load(std::memory_order_relaxed)) {
+                const long burst = burst_size(random);
+                for (long j = 0; j < burst; ++j) {
+                    queue.push_back(std::string(length(random), 'x'));
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(idle_ms(random)));
+            }
+        });
+    }
+    for (int i = 0; i < config.consumers; ++i) {
+        threads.emplace_back([&]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!queue.try_pop_front()) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::cout << "seconds,rss_bytes,depth,free_list,nodes,allocations,live_allocations" << std::endl;
+    std::vector<Sample> samples;
+    const auto started = std::chrono::steady_clock::now();
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(config.interval_seconds));
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        // These are approximate, since the counters are read while the
+        // threads are running.
+        const NodeCounters nodes = queue.stats().nodes;
+        const std::int64_t allocations = n_allocations.load();
+
+        Sample sample;
+        sample.seconds = seconds;
+        sample.rss = resident_bytes();
+        sample.depth = std::int64_t(queue.size_approx());
+        sample.free_list = nodes.cached();
+        sample.nodes = nodes.owned();
+        sample.allocations = allocations;
+        sample.live_allocations = allocations - std::int64_t(n_deallocations.load());
+        samples.push_back(sample);
+
+        std::cout << std::fixed << std::setprecision(1) << sample.seconds << std::defaultfloat << ','
+                  << sample.rss << ',' << sample.depth << ',' << sample.free_list << ','
+                  << sample.nodes << ',' << sample.allocations << ',' << sample.live_allocations
+                  << std::endl;
+
+        if (seconds >= config.seconds) {
+            break;
+        }
+    }
+
+    stop.store(true);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    const double warm = config.seconds * config.warm_up;
+    const double middle = warm + (config.seconds - warm) / 2;
+    const double end = samples.back().seconds + 1;
+    bool growing = false;
+    const auto check = [&](const char *what, auto field) {
+        const double first = peak(samples, warm, middle, field);
+        const double second = peak(samples, middle, end, field);
+        const double growth = first ? 100 * (second - first) / first : 0;
+        std::cerr << "peak " << what << ": " << first << " in first half, " << second
+                  << " in second half (" << std::showpos << growth << std::noshowpos << "%)\n";
+        if (growth > config.tolerance_percent) {
+            std::cerr << "possible unbounded growth in " << what << '\n';
+            growing = true;
+        }
+    };
+    check("RSS", &Sample::rss);
+    check("nodes", &Sample::nodes);
+    check("live allocations", &Sample::live_allocations);
+    return growing ? 1 : 0;
+}
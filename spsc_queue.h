@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+// `SpscQueue<T>` is an unbounded first-in-first-out queue for exactly one
+// producer thread and one consumer thread at a time. It has the same
+// `push_back` and `try_pop_front` as `Queue`, but performs no
+// compare-and-swap at all: the producer alone writes the tail, and the
+// consumer alone writes the head.
+//
+// It's a linked list with a "dummy" node in front, like `Queue`. Nodes that
+// the consumer has passed are recycled by the producer, which keeps them in
+// a cache between `first` and the consumer's `head` (Dmitry Vyukov's
+// unbounded SPSC queue). The producer reads `head` only when it has used up
+// the nodes it knew to be free, so the two threads rarely touch each other's
+// cache lines. Like `Queue`'s free list, the cache never shrinks.
+//
+// Publishing an element and checking for one are sequentially consistent,
+// so that `EventCount` can be used to wait for elements, as with `Queue`.
+template <typename T>
+class SpscQueue {
+    struct Node {
+        union {
+            T value;
+        };
+        std::atomic<Node*> next;
+
+        Node()
+        : next(nullptr) {}
+
+        ~Node() {}
+    };
+
+    // Written by the consumer. `head` is the dummy node.
+    alignas(64) std::atomic<Node*> head;
+    // Written by the producer. Nodes from `first` up to, but not including,
+    // `head_copy` are free, and `head_copy` is a recent value of `head`.
+    alignas(64) Node *tail;
+    Node *first;
+    Node *head_copy;
+
+public:
+    SpscQueue();
+    ~SpscQueue();
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    template <typename Value>
+    void push_back(Value&& value);
+
+    std::optional<T> try_pop_front();
+
+    bool empty() const;
+
+private:
+    Node *allocate();
+};
+
+template <typename T>
+SpscQueue<T>::SpscQueue()
+: head(new Node) // "dummy" node
+, tail(head.load())
+, first(tail)
+, head_copy(tail) {}
+
+template <typename T>
+SpscQueue<T>::~SpscQueue() {
+    // Free nodes have no value, and neither does the dummy.
+    const Node *const dummy = head.load();
+    bool has_value = false;
+    for (Node *node = first, *next; node; node = next) {
+        next = node->next.load();
+        if (has_value) {
+            node->value.~T();
+        }
+        has_value = has_value || node == dummy;
+        delete node;
+    }
+}
+
+template <typename T>
+template <typename Value>
+void SpscQueue<T>::push_back(Value&& value) {
+    Node *const node = allocate();
+    new (&node->value) T(std::forward<Value>(value));
+    node->next.store(nullptr, std::memory_order_relaxed);
+    tail->next.store(node);
+    tail = node;
+}
+
+template <typename T>
+std::optional<T> SpscQueue<T>::try_pop_front() {
+    Node *const dummy = head.load(std::memory_order_relaxed);
+    Node *const next = dummy->next.load();
+    if (!next) {
+        return std::nullopt;
+    }
+    std::optional<T> result(std::move(next->value));
+    next->value.~T();
+    // Hand `dummy` to the producer. `next` is the new dummy.
+    head.store(next, std::memory_order_release);
+    return result;
+}
+
+template <typename T>
+bool SpscQueue<T>::empty() const {
+    return !head.load()->next.load();
+}
+
+template <typename T>
+typename SpscQueue<T>::Node *SpscQueue<T>::allocate() {
+    if (first == head_copy) {
+        head_copy = head.load(std::memory_order_acquire);
+        if (first == head_copy) {
+            return new Node;
+        }
+    }
+    Node *const node = first;
+    first = first->next.load(std::memory_order_relaxed);
+    return node;
+}
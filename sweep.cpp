@@ -0,0 +1,81 @@
+// This program measures how the producer/consumer throughput of each queue
+// engine scales with the number of threads, for each strategy of placing
+// threads on CPUs (see `Placement` in `topology.h`). It writes the scaling
+// curves to standard output as CSV, one row per (placement, engine, split).
+//
+// By default, the thread counts are the powers of two up to the number of
+// CPUs available, plus that number. `--threads` overrides this, though
+// counts below two are skipped, since a split needs a producer and a
+// consumer.
+
+#include "bench.h"
+#include "bench_results.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+std::vector<int> default_thread_counts(int n_cpus) {
+    std::vector<int> counts;
+    for (int n = 2; n < n_cpus; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(std::max(2, n_cpus));
+    return counts;
+}
+
+std::string join(const std::vector<int>& values, std::size_t count) {
+    std::string result;
+    for (std::size_t i = 0; i < count && i < values.size(); ++i) {
+        if (i) {
+            result += ' ';
+        }
+        result += std::to_string(values[i]);
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = parse_bench_args(argc, argv);
+    config.print = false;
+
+    const std::vector<Cpu> cpus = read_topology();
+    if (!config.thread_counts_given) {
+        config.thread_counts = default_thread_counts(int(cpus.size()));
+    }
+
+    std::cout << "# topology: " << topology_fingerprint(cpus) << '\n'
+              << "placement,engine,producers,consumers,threads,cpus,ops_per_sec,ci95_ops_per_sec\n";
+
+    const long ops = config.ops_per_thread;
+    for (const Placement placement : {Placement::compact, Placement::cores, Placement::spread, Placement::unpinned}) {
+        const std::vector<int> order = place(cpus, placement);
+        for_each_engine([&]<template <typename> class Q>() {
+            for (const int n_threads : config.thread_counts) {
+                // A split needs at least one producer and one consumer.
+                if (n_threads < 2) {
+                    continue;
+                }
+                // Balanced splits show the most contention, since both ends of
+                // the queue are busy.
+                const int producers = n_threads / 2;
+                const int consumers = n_threads - producers;
+                const std::string name = std::string(placement_name(placement)) + " "
+                    + EngineTraits<Q>::name + "<int> pairs "
+                    + std::to_string(producers) + "P:" + std::to_string(consumers) + "C";
+                const BenchResult result = measure(config, name, n_threads, [&]() {
+                    const auto queue = EngineTraits<Q>::template make<int>(pairs_capacity);
+                    return run_pairs<int, PayloadTraits<int>>(*queue, producers, consumers, ops, order);
+                });
+                if (result.ops_per_second.empty()) {
+                    continue;
+                }
+                std::cout << placement_name(placement) << ',' << EngineTraits<Q>::name << ','
+                          << producers << ',' << consumers << ',' << n_threads << ','
+                          << join(order, n_threads) << ','
+                          << result.mean() << ',' << result.ci95() << std::endl;
+            }
+        });
+    }
+    return save_results(config, "sweep") ? 0 : 1;
+}
@@ -1,10 +1,42 @@
+#include "bench_results.h"
+#include "channel.h"
+#include "codel_queue.h"
+#include "depth_sampler.h"
+#include "eventfd_notifier.h"
+#include "futex.h"
+#include "latency.h"
+#include "lock_free_bag.h"
 #include "lock_free_queue.h"
+#include "msg_ring_notifier.h"
+#include "partitioned_queue.h"
+#include "priority_lanes_queue.h"
+#include "queue_instrumentation.h"
+#include "recording_queue.h"
+#include "reference_queues.h"
+#include "selector.h"
+#include "spsc_queue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <cerrno>
+#include <coroutine>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <poll.h>
+
 void test() {
     Queue<std::string> queue;
     const int n_threads = 4;
@@ -35,8 +67,1035 @@ void test() {
     }
 }
 
+void test_bag() {
+    LockFreeBag<std::string> bag;
+    const int n_threads = 4;
+    const int rounds = 1'000;
+    std::atomic<int> n_removed(0);
+    std::vector<std::vector<std::string>> removed(n_threads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back([i, &bag, &n_removed, &removed]() {
+            // Even threads only add, and odd threads only remove, so that
+            // most removals have to steal.
+            if (i % 2 == 0) {
+                for (int j = 0; j < rounds; ++j) {
+                    bag.add("element " + std::to_string(j) + " from thread " + std::to_string(i));
+                }
+                return;
+            }
+            while (n_removed.load() < rounds * n_threads / 2) {
+                if (std::optional<std::string> element = bag.try_remove()) {
+                    removed[i].push_back(std::move(*element));
+                    ++n_removed;
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    assert(n_removed.load() == rounds * n_threads / 2);
+    assert(!bag.try_remove());
+
+    // Every element that was added came out exactly once.
+    std::vector<std::string> expected;
+    std::vector<std::string> actual;
+    for (int i = 0; i < n_threads; ++i) {
+        if (i % 2 == 0) {
+            for (int j = 0; j < rounds; ++j) {
+                expected.push_back("element " + std::to_string(j) + " from thread " + std::to_string(i));
+            }
+        }
+        actual.insert(actual.end(), removed[i].begin(), removed[i].end());
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    assert(actual == expected);
+
+    // Leave some elements behind for the destructor.
+    for (int i = 0; i < 100; ++i) {
+        bag.add(std::to_string(i));
+    }
+}
+
+void test_bag_recycling() {
+    // Producers only add and consumers only remove, so every node a consumer
+    // gets has to find its way back to a producer. With at most `limit`
+    // elements in the bag at a time, the number of nodes allocated levels
+    // off instead of growing with the number of elements added.
+    LockFreeBag<int> bag;
+    const int n_producers = 2;
+    const int n_consumers = 2;
+    const int rounds = 20'000;
+    const int limit = 100;
+    std::atomic<int> n_added(0);
+    std::atomic<int> n_removed(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_producers; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < rounds; ++j) {
+                while (n_added.load() - n_removed.load() >= limit) {
+                    std::this_thread::yield();
+                }
+                ++n_added;
+                bag.add(j);
+            }
+        });
+    }
+    for (int i = 0; i < n_consumers; ++i) {
+        threads.emplace_back([&]() {
+            while (n_removed.load() < rounds * n_producers) {
+                if (bag.try_remove()) {
+                    ++n_removed;
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    assert(!bag.try_remove());
+    // Each producer's nodes are either in the bag, or on their way back to
+    // it, and a producer can overshoot `limit` by one for each producer.
+    const std::uint64_t allocations = bag.allocations();
+    assert(allocations >= 1);
+    assert(allocations <= std::uint64_t(n_producers) * (limit + n_producers));
+}
+
+void test_latency_histogram() {
+    LatencyHistogram histogram;
+    assert(histogram.value_at(0.5) == 0);
+
+    for (std::uint64_t value = 1; value <= 1'000; ++value) {
+        histogram.record(value);
+    }
+    histogram.record(1'000'000);
+
+    assert(histogram.count() == 1'001);
+    assert(histogram.max() == 1'000'000);
+    // Each value is reported to within the histogram's precision.
+    const auto near = [](std::uint64_t actual, std::uint64_t expected) {
+        return actual >= expected && actual <= expected + expected / LatencyHistogram::half;
+    };
+    assert(near(histogram.value_at(0.5), 501));
+    assert(near(histogram.value_at(0.99), 991));
+    assert(histogram.value_at(1.0) == 1'000'000);
+
+    // Every value falls into a bucket whose upper bound is at least the value.
+    for (std::uint64_t value : {0ULL, 1ULL, 127ULL, 128ULL, 129ULL, 12345ULL, ~0ULL}) {
+        const int bucket = LatencyHistogram::bucket_of(value);
+        assert(bucket >= 0 && bucket < LatencyHistogram::n_buckets);
+        assert(LatencyHistogram::highest_in(bucket) >= value);
+        assert(bucket == 0 || LatencyHistogram::highest_in(bucket - 1) < value);
+    }
+
+    LatencyHistogram merged;
+    merged.merge(histogram);
+    merged.merge(histogram);
+    assert(merged.count() == 2 * histogram.count());
+    assert(merged.value_at(0.5) == histogram.value_at(0.5));
+}
+
+void test_contention_counters() {
+    ContentionCounters<true> counters;
+    const int n_threads = 4;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back([&counters]() {
+            counters.attempt(CasSite::tail_link, false);
+            counters.attempt(CasSite::tail_link, true);
+            counters.bail(CasSite::free_list_pop);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    const QueueStats stats = counters.snapshot();
+    assert(stats[CasSite::tail_link].attempts == 2 * n_threads);
+    assert(stats[CasSite::tail_link].failures == n_threads);
+    assert(stats[CasSite::free_list_pop].bails == n_threads);
+    assert(stats[CasSite::before_first].attempts == 0);
+
+    // When disabled, the counters take no space in `Queue`.
+    static_assert(std::is_empty_v<ContentionCounters<false>>);
+}
+
+void test_allocation_counters() {
+    ContentionCounters<true> counters;
+    counters.allocated();
+    counters.miss(FreeListMiss::empty);
+    counters.allocated();
+    counters.returned();
+    counters.miss(FreeListMiss::busy);
+    counters.allocated();
+    counters.returned();
+    counters.hit();
+
+    const NodeCounters nodes = counters.snapshot().nodes;
+    assert(nodes.allocations == 3);
+    assert(nodes.free_list_misses() == 2 && nodes.free_list_busy == 1 && nodes.free_list_hits == 1);
+    assert(nodes.owned() == 3 && nodes.cached() == 1 && nodes.live() == 2);
+
+    if constexpr (queue_stats_enabled) {
+        Queue<int> queue;
+        for (int i = 0; i < 10; ++i) {
+            queue.push_back(i);
+        }
+        for (int i = 0; i < 10; ++i) {
+            (void)queue.try_pop_front();
+        }
+        queue.push_back(10);
+        const NodeCounters after = queue.stats().nodes;
+        // Every miss allocates, and so did the constructor.
+        assert(after.allocations == after.free_list_misses() + 1);
+        assert(after.free_list_returns == 10);
+        assert(after.owned() == after.live() + after.cached());
+        // The queue holds one element, after the dummy.
+        assert(after.live() == 2);
+    }
+}
+
+void test_fairness_recorder() {
+    FairnessRecorder<true> recorder;
+    FairnessRecorder<true>::Attempt attempt = recorder.begin();
+    recorder.retry();
+    recorder.retry();
+    recorder.end_push_back(attempt);
+    attempt = recorder.begin();
+    recorder.end_try_pop_front(attempt, false);
+    attempt = recorder.begin();
+    recorder.retry();
+    recorder.end_try_pop_front(attempt, true);
+
+    const QueueFairness fairness = recorder.snapshot();
+    assert(fairness.threads.size() == 1);
+    const ThreadFairness& thread = fairness.threads[0];
+    assert(thread.push_successes == 1 && thread.pop_successes == 1 && thread.pop_empty == 1);
+    assert(thread.longest_retry_streak == 2);
+    assert(thread.time_to_success.count() == 2);
+    assert(thread.first_tsc && thread.first_tsc <= thread.last_tsc);
+
+    assert(jain_index({}) == 1);
+    assert(jain_index({3, 3, 3}) == 1);
+    assert(jain_index({1, 0}) == 0.5);
+
+    static_assert(std::is_empty_v<FairnessRecorder<false>>);
+}
+
+// Have two producers push increasing numbers into `queue` while two
+// consumers pop them. Check that every element is popped exactly once, and
+// that each consumer sees each producer's elements in order.
+template <typename SomeQueue>
+void test_reference_queue(SomeQueue& queue) {
+    const int per_producer = 1'000;
+    std::atomic<int> n_popped(0);
+    std::vector<std::thread> threads;
+    for (int producer = 0; producer < 2; ++producer) {
+        threads.emplace_back([&queue, producer]() {
+            for (int i = 0; i < per_producer; ++i) {
+                queue.push_back(std::make_pair(producer, i));
+            }
+        });
+    }
+    for (int consumer = 0; consumer < 2; ++consumer) {
+        threads.emplace_back([&queue, &n_popped]() {
+            int last_seen[2] = {-1, -1};
+            while (n_popped.load() < 2 * per_producer) {
+                if (const auto element = queue.try_pop_front()) {
+                    assert(element->second > last_seen[element->first]);
+                    last_seen[element->first] = element->second;
+                    ++n_popped;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(n_popped.load() == 2 * per_producer);
+    assert(!queue.try_pop_front());
+}
+
+void test_reference_queues() {
+    using Element = std::pair<int, int>;
+    MutexDequeQueue<Element> mutex_deque;
+    test_reference_queue(mutex_deque);
+    SpinlockQueue<Element> spinlock;
+    test_reference_queue(spinlock);
+    TwoLockQueue<Element> two_lock;
+    test_reference_queue(two_lock);
+    // Small enough that producers have to wait for consumers.
+    BoundedRingQueue<Element> ring(16);
+    test_reference_queue(ring);
+
+    // Leave elements behind for the destructors.
+    BoundedRingQueue<std::string> strings(4);
+    assert(strings.try_push_back("one"));
+    assert(strings.try_push_back(std::string(100, 'x')));
+    TwoLockQueue<std::string> more_strings;
+    more_strings.push_back("two");
+}
+
+// Have two threads each push strings of known sizes into a `RecordingQueue`
+// and pop them back, then check that the traces read back match.
+void test_recording_queue() {
+    const std::string prefix = (std::filesystem::temp_directory_path() / "lock_free_queue_test").string();
+    const int per_thread = 100;
+    {
+        RecordingQueue<std::string> queue(prefix);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 2; ++i) {
+            threads.emplace_back([&queue]() {
+                for (int j = 0; j < per_thread; ++j) {
+                    queue.push_back(std::string(j, 'x'));
+                }
+                for (int j = 0; j < per_thread; ++j) {
+                    while (!queue.try_pop_front()) {}
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        assert(queue.trace_count() == 2);
+        assert(!queue.try_pop_front());
+    }
+
+    int n_pushes = 0, n_pops = 0;
+    for (int i = 0; i < 2; ++i) {
+        const std::string path = prefix + "." + std::to_string(i) + ".trace";
+        const std::vector<TraceEvent> events = read_trace(path);
+        std::remove(path.c_str());
+        for (std::size_t j = 0; j < events.size(); ++j) {
+            assert(j == 0 || events[j].ns >= events[j - 1].ns);
+            if (events[j].op == TraceOp::push) {
+                assert(events[j].size == std::uint32_t(n_pushes % per_thread));
+                ++n_pushes;
+            } else if (events[j].op == TraceOp::pop) {
+                assert(events[j].size < std::uint32_t(per_thread));
+                ++n_pops;
+            }
+        }
+    }
+    assert(n_pushes == 2 * per_thread);
+    assert(n_pops == 2 * per_thread);
+    // The main thread's final pop was recorded in a third trace.
+    const std::string path = prefix + ".2.trace";
+    const std::vector<TraceEvent> events = read_trace(path);
+    std::remove(path.c_str());
+    assert(events.size() == 1 && events[0].op == TraceOp::pop_empty);
+}
+
+void test_bench_results() {
+    // Samples {1..5} and {3..7} give t = -2 with 8 degrees of freedom.
+    const double p = welch_p_value({1, 2, 3, 4, 5}, {3, 4, 5, 6, 7});
+    assert(std::fabs(p - 0.0805) < 1e-3);
+    assert(welch_p_value({1, 2, 3}, {1, 2, 3}) == 1);
+    assert(welch_p_value({1}, {2, 3}) == 1);
+    assert(welch_p_value({1, 1}, {2, 2}) == 0);
+
+    ResultsFile file;
+    file.program = "test";
+    file.host.cpu = "Quoted \"CPU\"\\ with\ttabs";
+    file.repetitions = 2;
+    file.ops_per_thread = 1000;
+    file.results.push_back(BenchResult{"Queue<int>::push_back", 4, {1.5e7, 1.25e7}, {{"cycles", 123.5}}});
+    file.results.push_back(BenchResult{"empty", 1, {}, {}});
+    // Numbers that JSON can't represent are dropped.
+    const double infinity = std::numeric_limits<double>::infinity();
+    file.results.push_back(BenchResult{"degenerate", 1, {infinity, 2.5}, {{"cycles", std::nan("")}}});
+    const std::string path = (std::filesystem::temp_directory_path() / "lock_free_queue_test.json").string();
+    {
+        std::ofstream out(path);
+        write_results(out, file);
+    }
+    const ResultsFile read = read_results(path);
+    std::remove(path.c_str());
+    assert(read.program == "test");
+    assert(read.host.cpu == file.host.cpu);
+    assert(read.repetitions == 2 && read.ops_per_thread == 1000);
+    assert(read.results.size() == 3);
+    assert(read.results[0].name == "Queue<int>::push_back" && read.results[0].threads == 4);
+    assert(read.results[0].ops_per_second == file.results[0].ops_per_second);
+    assert(read.results[0].per_operation.size() == 1);
+    assert(read.results[0].per_operation[0].name == "cycles");
+    assert(read.results[0].per_operation[0].value == 123.5);
+    assert(read.results[1].ops_per_second.empty());
+    assert(read.results[2].ops_per_second == std::vector<double>{2.5});
+    assert(read.results[2].per_operation.empty());
+}
+
+// Have consumers sleep on an `EventCount` whenever `queue` is empty, and
+// check that producers' notifications wake them often enough that every
+// element is popped.
+void test_event_count() {
+    Queue<int> queue;
+    EventCount events;
+    const int per_producer = 1'000;
+    std::atomic<int> n_popped(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < per_producer; ++j) {
+                queue.push_back(j);
+                events.notify_one();
+            }
+        });
+    }
+    for (int i = 0; i < 2; ++i) {
+        // Each consumer pops exactly half, so neither waits for an element
+        // that the other took.
+        threads.emplace_back([&]() {
+            for (int popped = 0; popped < per_producer;) {
+                if (queue.try_pop_front()) {
+                    ++popped;
+                    continue;
+                }
+                const EventCount::Key key = events.prepare_wait();
+                if (queue.try_pop_front()) {
+                    events.cancel_wait();
+                    ++popped;
+                    continue;
+                }
+                events.wait(key);
+            }
+            n_popped += per_producer;
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(n_popped.load() == 2 * per_producer);
+    assert(!queue.try_pop_front());
+    assert(!events.has_waiters());
+
+    const EventCount::Key key = events.prepare_wait();
+    assert(!events.wait_for(key, std::chrono::milliseconds(1)));
+    assert(!events.has_waiters());
+}
+
+void test_size_approx() {
+    Queue<int> queue;
+    assert(queue.empty() && queue.size_approx() == 0 && queue.high_water_mark() == 0);
+    for (int i = 0; i < 10; ++i) {
+        queue.push_back(i);
+    }
+    assert(!queue.empty() && queue.size_approx() == 10);
+    for (int i = 0; i < 4; ++i) {
+        (void)queue.try_pop_front();
+    }
+    assert(queue.size_approx() == 6 && queue.high_water_mark() == 10);
+
+    // Counts from several threads add up once they're done.
+    const int per_thread = 1'000;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+        threads.emplace_back([&queue]() {
+            for (int j = 0; j < per_thread; ++j) {
+                queue.push_back(j);
+            }
+        });
+        threads.emplace_back([&queue]() {
+            for (int popped = 0; popped < per_thread / 2;) {
+                popped += bool(queue.try_pop_front());
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(queue.size_approx() == 6 + per_thread);
+    assert(queue.high_water_mark() >= 6 + per_thread);
+    while (queue.try_pop_front()) {}
+    assert(queue.empty() && queue.size_approx() == 0);
+
+    const std::string path = (std::filesystem::temp_directory_path() / "lock_free_queue_test.csv").string();
+    {
+        DepthSampler<Queue<int>> sampler(queue, path, std::chrono::milliseconds(1));
+        queue.push_back(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    assert(line == "seconds,size,high_water_mark");
+    int n_rows = 0;
+    while (std::getline(in, line)) {
+        ++n_rows;
+    }
+    assert(n_rows >= 2);
+    std::remove(path.c_str());
+}
+
+void test_bounded_queue() {
+    using namespace std::chrono_literals;
+
+    Queue<int> queue(2);
+    assert(queue.capacity() == 2 && Queue<int>().capacity() == Queue<int>::unbounded);
+    assert(queue.try_push_back(1) && queue.try_push_back(2));
+    int three = 3;
+    assert(!queue.try_push_back(three));
+    const auto before = std::chrono::steady_clock::now();
+    assert(!queue.try_push_back_for(three, 2ms));
+    assert(std::chrono::steady_clock::now() - before >= 2ms);
+    assert(queue.try_pop_front() == 1);
+    assert(queue.try_push_back_until(three, std::chrono::system_clock::now() + 1s));
+
+    // A blocked `push_back` resumes once a pop makes room.
+    std::atomic<bool> pushed(false);
+    std::thread producer([&]() {
+        queue.push_back(4);
+        pushed.store(true);
+    });
+    std::this_thread::sleep_for(10ms);
+    assert(!pushed.load());
+    assert(queue.try_pop_front() == 2);
+    producer.join();
+    assert(pushed.load() && queue.try_pop_front() == 3 && queue.try_pop_front() == 4);
+
+    // Under contention, producers block and resume without losing elements.
+    Queue<int> small(4);
+    const int per_producer = 1'000;
+    std::atomic<int> n_popped(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+        threads.emplace_back([&small]() {
+            for (int j = 0; j < per_producer; ++j) {
+                small.push_back(j);
+            }
+        });
+        threads.emplace_back([&small, &n_popped]() {
+            while (n_popped.load() < 2 * per_producer) {
+                if (small.try_pop_front()) {
+                    ++n_popped;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(n_popped.load() == 2 * per_producer && small.empty());
+}
+
+void test_eventfd_notifier() {
+    Queue<int> queue;
+    EventFdNotifier notifier;
+    queue.set_notifier(&notifier);
+    const auto readable = [&notifier]() {
+        pollfd descriptor = {notifier.fd(), POLLIN, 0};
+        return poll(&descriptor, 1, 0) == 1;
+    };
+
+    // Unarmed, pushes don't notify.
+    queue.push_back(1);
+    assert(!readable());
+    // Arming fails while there are elements.
+    assert(!notifier.arm(queue));
+    assert(queue.try_pop_front() == 1);
+
+    // Once armed, the first push notifies, and later ones don't.
+    assert(notifier.arm(queue));
+    assert(!readable());
+    for (int i = 0; i < 3; ++i) {
+        queue.push_back(i);
+    }
+    assert(readable());
+    assert(notifier.consume() == 1);
+    assert(!readable());
+
+    // A consumer in another thread sleeps in `poll` until a push wakes it.
+    while (queue.try_pop_front()) {}
+    std::thread consumer([&]() {
+        int n_popped = 0;
+        for (;;) {
+            while (queue.try_pop_front()) {
+                ++n_popped;
+            }
+            if (n_popped == 100) {
+                break;
+            }
+            if (notifier.arm(queue)) {
+                pollfd descriptor = {notifier.fd(), POLLIN, 0};
+                poll(&descriptor, 1, -1);
+                notifier.consume();
+            }
+        }
+    });
+    for (int i = 0; i < 100; ++i) {
+        queue.push_back(i);
+    }
+    consumer.join();
+    queue.set_notifier(nullptr);
+}
+
+void test_msg_ring_notifier() {
+    try {
+        IoUring probe;
+    } catch (const std::runtime_error&) {
+        std::cerr << "Skipping the io_uring test, because io_uring is unavailable.\n";
+        return;
+    }
+
+    const std::uint64_t user_data = 42;
+    for (const bool prefer_msg_ring : {true, false}) {
+        IoUring ring;
+        Queue<int> queue;
+        MsgRingNotifier notifier(ring, user_data, prefer_msg_ring);
+        assert(prefer_msg_ring || !notifier.uses_msg_ring());
+        queue.set_notifier(&notifier);
+        const auto wait_for_wakeup = [&]() {
+            assert(ring.submit(1) >= 0);
+            io_uring_cqe completion;
+            assert(ring.pop_completion(completion) && completion.user_data == user_data);
+            assert(!ring.pop_completion(completion));
+            notifier.consume();
+        };
+
+        // A producer without a ring wakes the consumer right away.
+        assert(notifier.arm(queue));
+        notifier.watch(ring);
+        std::thread([&queue]() { queue.push_back(1); }).join();
+        wait_for_wakeup();
+        assert(queue.try_pop_front() == 1);
+
+        if (!notifier.uses_msg_ring()) {
+            continue;
+        }
+        // A producer with a ring sends the wakeup when it next submits.
+        assert(notifier.arm(queue));
+        std::atomic<int> step(0);
+        std::thread producer([&]() {
+            IoUring own;
+            notifier.attach(&own);
+            queue.push_back(2);
+            step.store(1);
+            while (step.load() != 2) {}
+            assert(own.submit() == 1);
+            notifier.attach(nullptr);
+        });
+        while (step.load() != 1) {}
+        io_uring_cqe completion;
+        assert(ring.submit() == 0 && !ring.pop_completion(completion));
+        step.store(2);
+        producer.join();
+        wait_for_wakeup();
+        assert(queue.try_pop_front() == 2);
+
+        // A message that fails is resent through the eventfd, which the
+        // consumer's ring has been polling since the first `watch`.
+        io_uring_cqe failure = {};
+        failure.user_data = user_data;
+        assert(!notifier.handle_completion(failure));
+        failure.user_data = notifier.sender_user_data();
+        failure.res = -EOVERFLOW;
+        assert(notifier.handle_completion(failure));
+        wait_for_wakeup();
+        notifier.watch(ring);
+        assert(ring.submit() == 1 && !ring.pop_completion(completion));
+    }
+}
+
+// Pop `n` elements from `queue` into `received`.
+template <typename Executor>
+Detached pop_into(Queue<int>& queue, int n, std::vector<int>& received, Executor *executor) {
+    for (int i = 0; i < n; ++i) {
+        if (executor) {
+            received.push_back(co_await queue.pop(*executor));
+        } else {
+            received.push_back(co_await queue.pop());
+        }
+    }
+}
+
+// `ManualExecutor` resumes coroutines when told to.
+struct ManualExecutor {
+    std::vector<std::coroutine_handle<>> ready;
+
+    void schedule(std::coroutine_handle<> handle) {
+        ready.push_back(handle);
+    }
+
+    void run() {
+        for (std::coroutine_handle<> handle : std::exchange(ready, {})) {
+            handle.resume();
+        }
+    }
+};
+
+void test_async_pop() {
+    ManualExecutor *const inline_resume = nullptr;
+
+    // The first element is already there, and the rest resume the
+    // coroutine from `push_back`.
+    Queue<int> queue;
+    std::vector<int> received;
+    queue.push_back(1);
+    pop_into(queue, 3, received, inline_resume);
+    assert(received == std::vector<int>{1});
+    queue.push_back(2);
+    assert((received == std::vector<int>{1, 2}));
+    queue.push_back(3);
+    queue.push_back(4);
+    assert((received == std::vector<int>{1, 2, 3}));
+    assert(queue.try_pop_front() == 4);
+
+    // Waiters are served in the order in which they began waiting.
+    std::vector<int> first, second;
+    pop_into(queue, 1, first, inline_resume);
+    pop_into(queue, 1, second, inline_resume);
+    queue.push_back(10);
+    queue.push_back(20);
+    assert(first == std::vector<int>{10} && second == std::vector<int>{20});
+
+    // With an executor, the push only schedules the coroutine.
+    ManualExecutor executor;
+    received.clear();
+    pop_into(queue, 1, received, &executor);
+    queue.push_back(5);
+    assert(received.empty() && executor.ready.size() == 1);
+    executor.run();
+    assert(received == std::vector<int>{5});
+
+    // A coroutine resumed by pushes from several threads gets everything.
+    const int per_producer = 1'000;
+    received.clear();
+    pop_into(queue, 2 * per_producer, received, inline_resume);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+        threads.emplace_back([&queue]() {
+            for (int j = 0; j < per_producer; ++j) {
+                queue.push_back(j);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(received.size() == 2 * per_producer && queue.empty());
+}
+
+void test_codel_queue() {
+    using namespace std::chrono_literals;
+
+    // Elements past the deadline are dropped, and handed to the handler.
+    std::vector<int> diverted;
+    CoDelParams params;
+    params.deadline = 5ms;
+    CoDelQueue<int> expiring(params, [&diverted](int&& value, std::chrono::nanoseconds sojourn) {
+        assert(sojourn > 5ms);
+        diverted.push_back(value);
+    });
+    for (int i = 0; i < 10; ++i) {
+        expiring.push_back(i);
+    }
+    std::this_thread::sleep_for(10ms);
+    expiring.push_back(10);
+    std::chrono::nanoseconds sojourn;
+    assert(expiring.try_pop_front(sojourn) == 10 && sojourn < 5ms);
+    assert(expiring.dropped() == 10 && diverted.size() == 10 && diverted[9] == 9);
+    assert(!expiring.try_pop_front());
+
+    // Nothing is dropped until sojourn times have exceeded the target for an
+    // interval, and then elements are dropped until they're back under it.
+    params = CoDelParams();
+    params.target = 1ms;
+    params.interval = 5ms;
+    CoDelQueue<int> standing(params);
+    const int n_elements = 100;
+    for (int i = 0; i < n_elements; ++i) {
+        standing.push_back(i);
+    }
+    std::this_thread::sleep_for(2ms);
+    int n_popped = 0;
+    n_popped += bool(standing.try_pop_front());
+    assert(n_popped == 1 && standing.dropped() == 0);
+    std::this_thread::sleep_for(6ms);
+    n_popped += bool(standing.try_pop_front());
+    assert(n_popped == 2 && standing.dropped() >= 1);
+    while (standing.try_pop_front()) {
+        ++n_popped;
+    }
+    assert(n_popped + standing.dropped() == n_elements);
+
+    // A fresh element is under the target, which ends the dropping.
+    const std::uint64_t dropped = standing.dropped();
+    standing.push_back(n_elements);
+    assert(standing.try_pop_front() == n_elements && standing.dropped() == dropped);
+}
+
+void test_spsc_queue() {
+    // Elements come out in order, and recycled nodes don't disturb that.
+    SpscQueue<std::string> queue;
+    const int n_elements = 10'000;
+    std::thread producer([&queue]() {
+        for (int i = 0; i < n_elements; ++i) {
+            queue.push_back(std::to_string(i));
+        }
+    });
+    for (int expected = 0; expected < n_elements;) {
+        if (const std::optional<std::string> value = queue.try_pop_front()) {
+            assert(*value == std::to_string(expected));
+            ++expected;
+        }
+    }
+    producer.join();
+    assert(queue.empty() && !queue.try_pop_front());
+
+    // The destructor destroys elements that were never popped.
+    SpscQueue<std::string> abandoned;
+    abandoned.push_back("one");
+    abandoned.push_back("two");
+    assert(abandoned.try_pop_front() == "one");
+    abandoned.push_back("three");
+}
+
+void test_channel() {
+    using namespace std::chrono_literals;
+
+    // The channel closes once every sender is gone and it's drained.
+    auto [sender, receiver] = make_channel<int>();
+    static_assert(std::is_same_v<ChannelEngine<int, true, true>, Queue<int>>);
+    assert(receiver.try_receive().status == ChannelStatus::empty);
+    assert(receiver.receive_for(1ms).status == ChannelStatus::empty);
+    const int n_senders = 3;
+    const int n_per_sender = 1000;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_senders; ++i) {
+        threads.emplace_back([copy = sender]() mutable {
+            for (int j = 0; j < n_per_sender; ++j) {
+                assert(copy.send(j));
+            }
+        });
+    }
+    {
+        const auto last = std::move(sender);
+    }
+    std::atomic<int> n_received(0);
+    std::vector<std::thread> receivers;
+    for (int i = 0; i < 2; ++i) {
+        receivers.emplace_back([copy = receiver, &n_received]() mutable {
+            while (copy.receive()) {
+                ++n_received;
+            }
+            assert(copy.try_receive().status == ChannelStatus::closed);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (std::thread& thread : receivers) {
+        thread.join();
+    }
+    assert(n_received == n_senders * n_per_sender);
+    assert(receiver.receive_for(1ms).status == ChannelStatus::closed);
+
+    // Sending fails once every receiver is gone.
+    auto spsc = make_channel<std::string, false, false>();
+    static_assert(std::is_same_v<decltype(spsc)::Engine, SpscQueue<std::string>>);
+    static_assert(!std::is_copy_constructible_v<decltype(spsc.sender)>);
+    static_assert(!std::is_copy_constructible_v<decltype(spsc.receiver)>);
+    std::thread consumer([only = std::move(spsc.receiver)]() mutable {
+        assert(only.receive() == "hello");
+    });
+    std::string message = "hello";
+    assert(spsc.sender.send(std::move(message)));
+    consumer.join();
+    std::string unsent = "goodbye";
+    assert(spsc.sender.closed() && !spsc.sender.send(std::move(unsent)) && unsent == "goodbye");
+}
+
+void test_selector() {
+    using namespace std::chrono_literals;
+
+    // Weighted round robin: while all are ready, each queue gets its weight's
+    // worth of consecutive turns.
+    Queue<int> queues[3];
+    Selector<Queue<int>> selector({&queues[0], &queues[1], &queues[2]}, {2, 1, 1});
+    assert(!selector.try_select() && !selector.select_for(1ms));
+    for (Queue<int>& queue : queues) {
+        for (int i = 0; i < 10; ++i) {
+            queue.push_back(i);
+        }
+    }
+    std::vector<std::size_t> chosen;
+    for (int i = 0; i < 8; ++i) {
+        const std::size_t index = selector.select();
+        assert(queues[index].try_pop_front());
+        chosen.push_back(index);
+    }
+    assert((chosen == std::vector<std::size_t>{0, 0, 1, 2, 0, 0, 1, 2}));
+
+    // A queue that isn't ready is skipped.
+    while (queues[1].try_pop_front()) {}
+    chosen.clear();
+    for (int i = 0; i < 3; ++i) {
+        const std::size_t index = selector.select();
+        assert(queues[index].try_pop_front());
+        chosen.push_back(index);
+    }
+    assert((chosen == std::vector<std::size_t>{0, 0, 2}));
+    for (Queue<int>& queue : queues) {
+        while (queue.try_pop_front()) {}
+    }
+
+    // A push into any queue wakes the selector, which reports that queue.
+    for (const std::size_t target : {2, 0, 1}) {
+        std::thread producer([&queues, target]() {
+            std::this_thread::sleep_for(1ms);
+            queues[target].push_back(int(target));
+        });
+        const std::size_t index = selector.select();
+        assert(index == target && queues[index].try_pop_front() == int(target));
+        producer.join();
+    }
+}
+
+void test_priority_lanes_queue() {
+    // Without rotation, the most urgent nonempty lane is always served first,
+    // and each lane is first-in-first-out.
+    PriorityLanesQueue<int, 4> strict;
+    assert(strict.empty() && !strict.try_pop_front());
+    strict.push_back(3, 30);
+    strict.push_back(1, 10);
+    strict.push_back(3, 31);
+    strict.push_back(1, 11);
+    strict.push_back(0, 0);
+    assert(!strict.empty());
+    std::size_t lane;
+    for (const int expected : {0, 10, 11, 30, 31}) {
+        assert(strict.try_pop_front(lane) == expected && lane == std::size_t(expected / 10));
+    }
+    assert(strict.empty() && !strict.try_pop_front());
+
+    // With rotation, a busy urgent lane can't starve the others.
+    PriorityLanesQueue<int, 4> rotating(2);
+    for (int i = 0; i < 10; ++i) {
+        rotating.push_back(0, i);
+        rotating.push_back(3, 30 + i);
+    }
+    std::vector<std::size_t> served;
+    for (int i = 0; i < 8; ++i) {
+        assert(rotating.try_pop_front(lane));
+        served.push_back(lane);
+    }
+    assert((served == std::vector<std::size_t>{0, 0, 0, 3, 0, 0, 0, 3}));
+
+    // Concurrent producers on every lane lose nothing and reorder nothing
+    // within a lane.
+    PriorityLanesQueue<int, 4> shared;
+    const int n_per_lane = 1000;
+    std::vector<std::thread> producers;
+    for (std::size_t i = 0; i < shared.n_lanes; ++i) {
+        producers.emplace_back([&shared, i]() {
+            for (int j = 0; j < n_per_lane; ++j) {
+                shared.push_back(i, j);
+            }
+        });
+    }
+    int next[4] = {0, 0, 0, 0};
+    for (int n_popped = 0; n_popped < n_per_lane * 4;) {
+        if (const std::optional<int> value = shared.try_pop_front(lane)) {
+            assert(*value == next[lane]);
+            ++next[lane];
+            ++n_popped;
+        }
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+    assert(shared.empty());
+}
+
+void test_partitioned_queue() {
+    // A claimed partition can't be claimed again until it's released.
+    PartitionedQueue<int, int> small(2);
+    assert(!small.try_claim());
+    small.push_back(0, 0);
+    small.push_back(1, 1);
+    {
+        auto first = small.try_claim();
+        auto second = small.try_claim();
+        assert(first && second && first->partition() != second->partition());
+        assert(!small.try_claim());
+        assert(second->try_pop_front() == int(second->partition()));
+        assert(!second->try_pop_front());
+    }
+    assert(small.try_process([](int) {}) == 1 && small.empty() && !small.try_claim());
+
+    // Elements with the same key are processed in order, by one consumer at
+    // a time, even though several consumers run at once.
+    struct Event {
+        int key;
+        int sequence;
+    };
+    const int n_keys = 20;
+    const int n_producers = 2;
+    const int n_per_producer = 2000;
+    PartitionedQueue<int, Event> events(8);
+    std::vector<std::atomic<int>> busy(events.size());
+    std::vector<int> last_sequence(n_keys * n_producers, -1);
+    std::atomic<int> n_processed(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_producers; ++i) {
+        threads.emplace_back([&events, i]() {
+            for (int j = 0; j < n_per_producer; ++j) {
+                // Keys are distinct per producer, so each key's sequence
+                // numbers are pushed in order.
+                const int key = i * n_keys + j % n_keys;
+                events.push_back(key, Event{key, j});
+            }
+        });
+    }
+    for (int i = 0; i < 3; ++i) {
+        threads.emplace_back([&]() {
+            while (n_processed.load() < n_producers * n_per_producer) {
+                events.try_process([&](Event event) {
+                    std::atomic<int>& in_partition = busy[events.partition_of(event.key)];
+                    assert(in_partition.fetch_add(1) == 0);
+                    assert(event.sequence > last_sequence[event.key]);
+                    last_sequence[event.key] = event.sequence;
+                    ++n_processed;
+                    in_partition.fetch_sub(1);
+                }, 16);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(events.empty());
+}
+
 int main() {
     std::cout << "Beginning test.\n";
     test();
+    test_bag();
+    test_bag_recycling();
+    test_latency_histogram();
+    test_contention_counters();
+    test_allocation_counters();
+    test_fairness_recorder();
+    test_reference_queues();
+    test_recording_queue();
+    test_bench_results();
+    test_event_count();
+    test_size_approx();
+    test_bounded_queue();
+    test_eventfd_notifier();
+    test_msg_ring_notifier();
+    test_async_pop();
+    test_codel_queue();
+    test_spsc_queue();
+    test_channel();
+    test_selector();
+    test_priority_lanes_queue();
+    test_partitioned_queue();
     std::cout << "Test complete.\n";
 }
@@ -0,0 +1,229 @@
+#pragma once
+
+// This file contains a reader for the CPU topology that Linux describes in
+// `/sys/devices/system/cpu`, strategies for placing benchmark threads on
+// CPUs according to that topology, and a function for pinning a thread to
+// a CPU.
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+struct Cpu {
+    int id;
+    // Physical core, unique within `package`.
+    int core;
+    // Socket.
+    int package;
+    // The lowest-numbered CPU that shares this CPU's last level cache, or
+    // `-1` if unknown.
+    int llc;
+    // This CPU's position among the hardware threads (SMT siblings) of its
+    // core: 0 for the first, 1 for the second, etc.
+    int smt_index;
+};
+
+// Parse a CPU list such as "0-3,8,10-11", as used in `/sys`. Return an empty
+// vector if `text` is malformed.
+inline std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::istringstream in(text);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        const std::size_t dash = range.find('-');
+        char *end;
+        const long first = std::strtol(range.c_str(), &end, 10);
+        if (end == range.c_str()) {
+            return {};
+        }
+        const long last = dash == std::string::npos ? first : std::strtol(range.c_str() + dash + 1, &end, 10);
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(int(cpu));
+        }
+    }
+    return cpus;
+}
+
+// Return the first line of the file at `path`, or an empty string if it
+// can't be read.
+inline std::string read_first_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// Return the CPUs that this process is allowed to run on, with their
+// topology. Information that `/sys` doesn't provide is filled in as if each
+// CPU were its own core in a single package.
+inline std::vector<Cpu> read_topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof allowed, &allowed)) {
+        CPU_ZERO(&allowed);
+    }
+
+    const std::string root = "/sys/devices/system/cpu/";
+    std::vector<Cpu> cpus;
+    for (const int id : parse_cpu_list(read_first_line(root + "online"))) {
+        if (!CPU_ISSET(id, &allowed)) {
+            continue;
+        }
+        const std::string dir = root + "cpu" + std::to_string(id) + "/";
+        const std::string core = read_first_line(dir + "topology/core_id");
+        const std::string package = read_first_line(dir + "topology/physical_package_id");
+        Cpu cpu{id, core.empty() ? id : std::atoi(core.c_str()), std::atoi(package.c_str()), -1, 0};
+
+        for (int index = 0;; ++index) {
+            const std::string cache = dir + "cache/index" + std::to_string(index) + "/";
+            const std::string level = read_first_line(cache + "level");
+            if (level.empty()) {
+                break;
+            }
+            const std::vector<int> sharing = parse_cpu_list(read_first_line(cache + "shared_cpu_list"));
+            if (!sharing.empty() && std::atoi(level.c_str()) >= 2) {
+                // The highest level seen last wins.
+                cpu.llc = sharing.front();
+            }
+        }
+
+        const std::vector<int> siblings = parse_cpu_list(read_first_line(dir + "topology/thread_siblings_list"));
+        cpu.smt_index = int(std::find(siblings.begin(), siblings.end(), id) - siblings.begin());
+        if (cpu.smt_index == int(siblings.size())) {
+            cpu.smt_index = 0;
+        }
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Return a string that identifies the shape of the topology, e.g.
+// "2 packages, 4 LLCs, 32 cores, 64 CPUs".
+inline std::string topology_fingerprint(const std::vector<Cpu>& cpus) {
+    std::vector<int> packages, llcs;
+    std::vector<std::pair<int, int>> cores;
+    for (const Cpu& cpu : cpus) {
+        packages.push_back(cpu.package);
+        llcs.push_back(cpu.llc);
+        cores.emplace_back(cpu.package, cpu.core);
+    }
+    const auto distinct = [](auto values) {
+        std::sort(values.begin(), values.end());
+        return std::unique(values.begin(), values.end()) - values.begin();
+    };
+    std::ostringstream out;
+    out << distinct(packages) << " packages, " << distinct(llcs) << " LLCs, "
+        << distinct(cores) << " cores, " << cpus.size() << " CPUs";
+    return out.str();
+}
+
+// A `Placement` is a strategy for choosing which CPU each benchmark thread
+// runs on. Each returns the CPUs in the order that threads should be
+// assigned to them.
+enum class Placement {
+    // Fill each core's hardware threads, then the rest of its LLC, then the
+    // rest of its package, before moving on. Adjacent threads share as much
+    // as possible.
+    compact,
+    // Use one hardware thread of every core before using any core's second
+    // hardware thread. Otherwise like `compact`.
+    cores,
+    // Alternate between packages, and between LLCs within a package, so that
+    // adjacent threads share as little as possible.
+    spread,
+    // Don't pin threads. Leave placement to the scheduler.
+    unpinned
+};
+
+inline const char *placement_name(Placement placement) {
+    switch (placement) {
+    case Placement::compact: return "compact";
+    case Placement::cores: return "cores";
+    case Placement::spread: return "spread";
+    case Placement::unpinned: return "unpinned";
+    }
+    return "?";
+}
+
+inline std::vector<int> place(const std::vector<Cpu>& cpus, Placement placement) {
+    std::vector<Cpu> order = cpus;
+    switch (placement) {
+    case Placement::compact:
+        std::sort(order.begin(), order.end(), [](const Cpu& left, const Cpu& right) {
+            return std::tie(left.package, left.llc, left.core, left.smt_index)
+                 < std::tie(right.package, right.llc, right.core, right.smt_index);
+        });
+        break;
+    case Placement::cores:
+        std::sort(order.begin(), order.end(), [](const Cpu& left, const Cpu& right) {
+            return std::tie(left.smt_index, left.package, left.llc, left.core)
+                 < std::tie(right.smt_index, right.package, right.llc, right.core);
+        });
+        break;
+    case Placement::spread: {
+        // Group CPUs by LLC, and order the groups so that consecutive groups
+        // are in different packages where possible. Then deal CPUs out
+        // round-robin from the groups, preferring distinct cores.
+        std::map<int, std::map<int, std::vector<Cpu>>> packages;
+        for (const Cpu& cpu : cpus) {
+            packages[cpu.package][cpu.llc].push_back(cpu);
+        }
+        std::vector<std::vector<Cpu>> groups;
+        for (std::size_t round = 0; groups.size() < cpus.size(); ++round) {
+            bool any = false;
+            for (const auto& [package, llcs] : packages) {
+                if (round < llcs.size()) {
+                    groups.push_back(std::next(llcs.begin(), round)->second);
+                    any = true;
+                }
+            }
+            if (!any) {
+                break;
+            }
+        }
+        for (std::vector<Cpu>& group : groups) {
+            std::sort(group.begin(), group.end(), [](const Cpu& left, const Cpu& right) {
+                return std::tie(left.smt_index, left.core) < std::tie(right.smt_index, right.core);
+            });
+        }
+        order.clear();
+        for (std::size_t i = 0; order.size() < cpus.size(); ++i) {
+            for (const std::vector<Cpu>& group : groups) {
+                if (i < group.size()) {
+                    order.push_back(group[i]);
+                }
+            }
+        }
+        break;
+    }
+    case Placement::unpinned:
+        return {};
+    }
+
+    std::vector<int> ids;
+    for (const Cpu& cpu : order) {
+        ids.push_back(cpu.id);
+    }
+    return ids;
+}
+
+// Restrict the calling thread to run only on the specified CPU. Return
+// whether this succeeded.
+inline bool pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+// This file defines `LOCK_FREE_QUEUE_USDT_PROBE1`, `..._PROBE2` and
+// `..._PROBE3`, which place a USDT ("userland statically defined tracing")
+// probe with one, two or three integer arguments, as understood by bpftrace,
+// perf, SystemTap and friends. For example:
+//
+//     bpftrace -e 'usdt:./bench:lock_free_queue:free_list_miss { @[arg1] = count(); }'
+//
+// A probe is a single `nop` instruction, plus an ELF note recording its
+// address and where its arguments live. A tracer that attaches replaces the
+// `nop` with a breakpoint. Until then, a probe costs the `nop` and whatever
+// it takes to have its arguments in registers or memory, which is usually
+// nothing, since they're there already.
+//
+// If `<sys/sdt.h>` (from SystemTap) is available, its `DTRACE_PROBEn` macros
+// are used. Otherwise, on x86-64 and AArch64 ELF targets, an equivalent
+// subset of it is defined here. Elsewhere, the probes expand to nothing.
+//
+// All arguments are passed as signed 64-bit integers. Pointers are fine.
+
+#include <cstdint>
+
+#define LOCK_FREE_QUEUE_USDT_ARG(arg) ((std::int64_t)(arg))
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define LOCK_FREE_QUEUE_USDT_PROBE1(provider, name, a) \
+    DTRACE_PROBE1(provider, name, LOCK_FREE_QUEUE_USDT_ARG(a))
+#define LOCK_FREE_QUEUE_USDT_PROBE2(provider, name, a, b) \
+    DTRACE_PROBE2(provider, name, LOCK_FREE_QUEUE_USDT_ARG(a), LOCK_FREE_QUEUE_USDT_ARG(b))
+#define LOCK_FREE_QUEUE_USDT_PROBE3(provider, name, a, b, c) \
+    DTRACE_PROBE3(provider, name, LOCK_FREE_QUEUE_USDT_ARG(a), LOCK_FREE_QUEUE_USDT_ARG(b), \
+        LOCK_FREE_QUEUE_USDT_ARG(c))
+
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// This is the "stapsdt" note format, version 3, as emitted by `<sys/sdt.h>`.
+// The note holds the probe's address, the address of `_.stapsdt.base` (so
+// that tracers can account for prelinking), the address of a semaphore (none
+// here), and then the provider, the probe name, and the argument
+// descriptions as strings. Each argument is described as "-8@OPERAND",
+// meaning a signed 8-byte value at OPERAND, which the compiler fills in.
+#define LOCK_FREE_QUEUE_USDT_NOTE(provider, name, args, ...)                         \
+    __asm__ __volatile__(                                                           \
+        "990: nop\n"                                                                \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+        ".balign 4\n"                                                               \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+        "991: .asciz \"stapsdt\"\n"                                                 \
+        "992: .balign 4\n"                                                          \
+        "993: .8byte 990b\n"                                                        \
+        ".8byte _.stapsdt.base\n"                                                   \
+        ".8byte 0\n"                                                                \
+        ".asciz \"" #provider "\"\n"                                                \
+        ".asciz \"" #name "\"\n"                                                    \
+        ".asciz \"" args "\"\n"                                                     \
+        "994: .balign 4\n"                                                          \
+        ".popsection\n"                                                             \
+        ".ifndef _.stapsdt.base\n"                                                  \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+        ".weak _.stapsdt.base\n"                                                    \
+        ".hidden _.stapsdt.base\n"                                                  \
+        "_.stapsdt.base: .space 1\n"                                                \
+        ".size _.stapsdt.base, 1\n"                                                 \
+        ".popsection\n"                                                             \
+        ".endif\n"                                                                  \
+        : : __VA_ARGS__)
+
+#define LOCK_FREE_QUEUE_USDT_PROBE1(provider, name, a) \
+    LOCK_FREE_QUEUE_USDT_NOTE(provider, name, "-8@%0", "nor"(LOCK_FREE_QUEUE_USDT_ARG(a)))
+#define LOCK_FREE_QUEUE_USDT_PROBE2(provider, name, a, b) \
+    LOCK_FREE_QUEUE_USDT_NOTE(provider, name, "-8@%0 -8@%1", \
+        "nor"(LOCK_FREE_QUEUE_USDT_ARG(a)), "nor"(LOCK_FREE_QUEUE_USDT_ARG(b)))
+#define LOCK_FREE_QUEUE_USDT_PROBE3(provider, name, a, b, c) \
+    LOCK_FREE_QUEUE_USDT_NOTE(provider, name, "-8@%0 -8@%1 -8@%2", \
+        "nor"(LOCK_FREE_QUEUE_USDT_ARG(a)), "nor"(LOCK_FREE_QUEUE_USDT_ARG(b)), \
+        "nor"(LOCK_FREE_QUEUE_USDT_ARG(c)))
+
+#else
+
+#define LOCK_FREE_QUEUE_USDT_PROBE1(provider, name, a) ((void)(a))
+#define LOCK_FREE_QUEUE_USDT_PROBE2(provider, name, a, b) ((void)(a), (void)(b))
+#define LOCK_FREE_QUEUE_USDT_PROBE3(provider, name, a, b, c) ((void)(a), (void)(b), (void)(c))
+
+#endif